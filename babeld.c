@@ -53,6 +53,9 @@ THE SOFTWARE.
 #include "configuration.h"
 #include "local.h"
 #include "rule.h"
+#include "digest.h"
+#include "damping.h"
+#include "handoff.h"
 #include "version.h"
 
 struct timeval now;
@@ -64,12 +67,16 @@ int debug = 0;
 int link_detect = 0;
 int all_wireless = 0;
 int has_ipv6_subtrees = 0;
+int has_v4viav6 = 0;
 int default_wireless_hello_interval = -1;
 int default_wired_hello_interval = -1;
 int resend_delay = -1;
 int random_id = 0;
 int do_daemonise = 0;
 int skip_kernel_setup = 0;
+int housekeeping_budget = 0;
+int timer_slack = 0;
+int receive_rate = 0;
 const char *logfile = NULL,
     *pidfile = "/var/run/babeld.pid",
     *state_file = "/var/lib/babel-state";
@@ -90,15 +97,32 @@ static int kernel_routes_changed = 0;
 static int kernel_rules_changed = 0;
 static int kernel_link_changed = 0;
 static int kernel_addr_changed = 0;
+static int kernel_ifaddr_changed = 0;
+/* Kernel changes trigger a dump of the kernel tables, at most once
+   every KERNEL_CHECK_INTERVAL milliseconds. */
+static struct timeval kernel_check_time = {0, 0};
+#define KERNEL_CHECK_INTERVAL 250
+
+/* Housekeeping that is spread over multiple iterations of the main loop
+   when housekeeping_budget is set. */
+static int interfaces_pending = 0, routes_pending = 0,
+    resend_pending = 0, sources_pending = 0;
 
 struct timeval check_neighbours_timeout, check_interfaces_timeout;
 
+/* Number of times we returned from select, and the rate over the last
+   minute in hundredths of wakeups per second. */
+unsigned int wakeups = 0, wakeup_rate = 0;
+static unsigned int wakeup_window_count = 0;
+static time_t wakeup_window_time = 0;
+
 static volatile sig_atomic_t exiting = 0, dumping = 0, reopening = 0;
 
 static int accept_local_connections(fd_set *readfds);
 static void init_signals(void);
 static void dump_tables(FILE *out);
 static int reopen_logfile(void);
+static int write_pidfile(int flags);
 
 static int
 kernel_route_notify(struct kernel_route *route, void *closure)
@@ -110,7 +134,17 @@ kernel_route_notify(struct kernel_route *route, void *closure)
 static int
 kernel_addr_notify(struct kernel_addr *addr, void *closure)
 {
+    struct interface *ifp;
     kernel_addr_changed = 1;
+    /* Addresses on interfaces that we don't speak on only matter for
+       redistribution, don't rescan our interfaces for those.  They still
+       cause a dump, so they are not ignored. */
+    FOR_ALL_INTERFACES(ifp) {
+        if(ifp->ifindex == addr->ifindex) {
+            kernel_ifaddr_changed = 1;
+            break;
+        }
+    }
     return -1;
 }
 
@@ -143,17 +177,51 @@ kernel_rule_notify(struct kernel_rule *rule, void *closure)
     return -1;
 }
 
+/* Round a future timeout up to a multiple of slack milliseconds, so
+   that nearby timeouts expire in the same wakeup.  Jitter is preserved,
+   since the grid is relative to our own clock. */
+static void
+align_timeout(struct timeval *tv, int slack)
+{
+    unsigned long long ms;
+
+    if(timeval_compare(tv, &now) <= 0)
+        return;
+
+    ms = (unsigned long long)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+    ms = (ms + slack - 1) / slack * slack;
+    tv->tv_sec = ms / 1000;
+    tv->tv_usec = (ms % 1000) * 1000;
+}
+
+static void
+count_wakeup(void)
+{
+    wakeups++;
+    if(wakeup_window_time == 0) {
+        wakeup_window_time = now.tv_sec;
+        wakeup_window_count = wakeups;
+    } else if(now.tv_sec >= wakeup_window_time + 60) {
+        wakeup_rate = (wakeups - wakeup_window_count) * 100 /
+            (now.tv_sec - wakeup_window_time);
+        wakeup_window_time = now.tv_sec;
+        wakeup_window_count = wakeups;
+    }
+}
+
 int
 main(int argc, char **argv)
 {
     struct sockaddr_in6 sin6;
     int rc, fd, i, opt;
-    time_t expiry_time, source_expiry_time, kernel_dump_time;
+    time_t expiry_time, source_expiry_time, damping_time, kernel_dump_time;
+    time_t filter_sample_time;
     const char **config_files = NULL;
     int num_config_files = 0;
     void *vrc;
     unsigned int seed;
     struct interface *ifp;
+    int handoff, handed_off = 0;
 
     gettime(&now);
 
@@ -170,10 +238,11 @@ main(int argc, char **argv)
     protocol_port = 6696;
     change_smoothing_half_life(4);
     has_ipv6_subtrees = kernel_has_ipv6_subtrees();
+    has_v4viav6 = kernel_has_v4viav6();
 
     while(1) {
         opt = getopt(argc, argv,
-                     "m:p:h:H:i:k:A:sruS:d:g:lwz:M:t:T:c:C:DL:I:V");
+                     "m:p:h:H:i:k:A:sruS:d:g:G:lwz:M:t:T:c:C:DL:I:V");
         if(opt < 0)
             break;
 
@@ -238,12 +307,14 @@ main(int argc, char **argv)
                 goto usage;
             break;
         case 'g':
+        case 'G':
 #ifdef NO_LOCAL_INTERFACE
             fprintf(stderr, "Warning: no local interface in this version.\n");
 #else
             local_server_port = parse_nat(optarg);
             if(local_server_port <= 0 || local_server_port > 0xFFFF)
                 goto usage;
+            local_server_write = (opt == 'G');
 #endif
             break;
         case 'l':
@@ -355,6 +426,12 @@ main(int argc, char **argv)
     resend_delay = MIN(resend_delay, default_wired_hello_interval / 2);
     resend_delay = MAX(resend_delay, 20);
 
+    /* Are we being started by a running instance that is upgrading? */
+    handoff = handoff_check();
+    if(handoff < 0)
+        exit(1);
+    handoff_setup(argv[0]);
+
     if(do_daemonise) {
         if(logfile == NULL)
             logfile = "/var/log/babeld.log";
@@ -380,7 +457,9 @@ main(int argc, char **argv)
 
     close(fd);
 
-    if(do_daemonise) {
+    /* The old instance has already detached, and still owns the
+       pidfile. */
+    if(do_daemonise && !handoff) {
         rc = daemonise();
         if(rc < 0) {
             perror("daemonise");
@@ -388,32 +467,10 @@ main(int argc, char **argv)
         }
     }
 
-    if(pidfile && pidfile[0] != '\0') {
-        int pfd, len;
-        char buf[100];
-
-        len = snprintf(buf, 100, "%lu", (unsigned long)getpid());
-        if(len < 0 || len >= 100) {
-            perror("snprintf(getpid)");
-            exit(1);
-        }
-
-        pfd = open(pidfile, O_WRONLY | O_CREAT | O_EXCL, 0644);
-        if(pfd < 0) {
-            char buf[40];
-            snprintf(buf, 40, "creat(%s)", pidfile);
-            buf[39] = '\0';
-            perror(buf);
+    if(!handoff) {
+        rc = write_pidfile(O_EXCL);
+        if(rc < 0)
             exit(1);
-        }
-
-        rc = write(pfd, buf, len);
-        if(rc < len) {
-            perror("write(pidfile)");
-            goto fail_pid;
-        }
-
-        close(pfd);
     }
 
     rc = kernel_setup(1);
@@ -422,7 +479,10 @@ main(int argc, char **argv)
         goto fail_pid;
     }
 
-    rc = kernel_setup_socket(1);
+    if(handoff)
+        rc = handoff_receive_sockets();
+    else
+        rc = kernel_setup_socket(1);
     if(rc < 0) {
         fprintf(stderr, "kernel_setup_socket failed.\n");
         kernel_setup(0);
@@ -446,6 +506,13 @@ main(int argc, char **argv)
         goto fail;
     }
 
+    /* This gives us our router-id and seqnos. */
+    if(handoff) {
+        rc = handoff_receive_globals();
+        if(rc < 0)
+            goto fail;
+    }
+
     if(!have_id && !random_id) {
         /* We use all available interfaces here, since this increases the
            chances of getting a stable router-id in case the set of Babel
@@ -480,45 +547,47 @@ main(int argc, char **argv)
         myid[0] &= ~3;
     }
 
-    myseqno = (random() & 0xFFFF);
-
-    fd = open(state_file, O_RDONLY);
-    if(fd < 0 && errno != ENOENT)
-        perror("open(babel-state)");
-    rc = unlink(state_file);
-    if(fd >= 0 && rc < 0) {
-        perror("unlink(babel-state)");
-        /* If we couldn't unlink it, it's probably stale. */
-        close(fd);
-        fd = -1;
-    }
-    if(fd >= 0) {
-        char buf[100];
-        int s;
-        rc = read(fd, buf, 99);
-        if(rc < 0) {
-            perror("read(babel-state)");
-        } else {
-            buf[rc] = '\0';
-            rc = sscanf(buf, "%d\n", &s);
-            if(rc == 1 && s >= 0 && s <= 0xFFFF) {
-                myseqno = seqno_plus(s, 1);
+    if(!handoff) {
+        myseqno = (random() & 0xFFFF);
+
+        fd = open(state_file, O_RDONLY);
+        if(fd < 0 && errno != ENOENT)
+            perror("open(babel-state)");
+        rc = unlink(state_file);
+        if(fd >= 0 && rc < 0) {
+            perror("unlink(babel-state)");
+            /* If we couldn't unlink it, it's probably stale. */
+            close(fd);
+            fd = -1;
+        }
+        if(fd >= 0) {
+            char buf[100];
+            int s;
+            rc = read(fd, buf, 99);
+            if(rc < 0) {
+                perror("read(babel-state)");
             } else {
-                fprintf(stderr, "Couldn't parse babel-state.\n");
+                buf[rc] = '\0';
+                rc = sscanf(buf, "%d\n", &s);
+                if(rc == 1 && s >= 0 && s <= 0xFFFF) {
+                    myseqno = seqno_plus(s, 1);
+                } else {
+                    fprintf(stderr, "Couldn't parse babel-state.\n");
+                }
             }
+            close(fd);
+            fd = -1;
         }
-        close(fd);
-        fd = -1;
-    }
 
-    protocol_socket = babel_socket(protocol_port);
-    if(protocol_socket < 0) {
-        perror("Couldn't create link local socket");
-        goto fail;
+        protocol_socket = babel_socket(protocol_port);
+        if(protocol_socket < 0) {
+            perror("Couldn't create link local socket");
+            goto fail;
+        }
     }
 
 #ifndef NO_LOCAL_INTERFACE
-    if(local_server_port >= 0) {
+    if(local_server_port >= 0 && local_server_socket < 0) {
         local_server_socket = tcp_server_socket(local_server_port, 1);
         if(local_server_socket < 0) {
             perror("local_server_socket");
@@ -534,29 +603,37 @@ main(int argc, char **argv)
     if(receive_buffer == NULL)
         goto fail;
 
-    check_interfaces();
+    check_interfaces(0);
 
-    rc = check_xroutes(0);
+    if(handoff) {
+        rc = handoff_receive_state();
+        if(rc < 0)
+            goto fail;
+        write_pidfile(O_TRUNC);
+    }
+
+    rc = check_xroutes(0, 1);
     if(rc < 0)
         fprintf(stderr, "Warning: couldn't check exported routes.\n");
-    rc = check_rules();
-    if(rc < 0)
-        fprintf(stderr, "Warning: couldn't check rules.\n");
 
     kernel_routes_changed = 0;
     kernel_rules_changed = 0;
     kernel_link_changed = 0;
     kernel_addr_changed = 0;
+    kernel_ifaddr_changed = 0;
     kernel_dump_time = now.tv_sec + roughly(30);
     schedule_neighbours_check(5000, 1);
     schedule_interfaces_check(30000, 1);
     expiry_time = now.tv_sec + roughly(30);
     source_expiry_time = now.tv_sec + roughly(300);
+    damping_time = now.tv_sec + roughly(5);
+    filter_sample_time = now.tv_sec + roughly(60);
 
     /* Make some noise so that others notice us, and send retractions in
-       case we were restarted recently */
+       case we were restarted recently.  After an upgrade, our neighbours
+       never noticed we were gone. */
     FOR_ALL_INTERFACES(ifp) {
-        if(!if_up(ifp))
+        if(!if_up(ifp) || handoff)
             continue;
         /* Apply jitter before we send the first message. */
         usleep(roughly(10000));
@@ -566,7 +643,7 @@ main(int argc, char **argv)
     }
 
     FOR_ALL_INTERFACES(ifp) {
-        if(!if_up(ifp))
+        if(!if_up(ifp) || handoff)
             continue;
         usleep(roughly(10000));
         gettime(&now);
@@ -583,6 +660,8 @@ main(int argc, char **argv)
     while(1) {
         struct timeval tv;
         fd_set readfds;
+        int pending, urgent = 0, slept = 0;
+        struct timeval flush_limit;
 
         gettime(&now);
 
@@ -591,7 +670,14 @@ main(int argc, char **argv)
         timeval_min_sec(&tv, expiry_time);
         timeval_min_sec(&tv, source_expiry_time);
         timeval_min_sec(&tv, kernel_dump_time);
+        if(filter_sample_time >= 0)
+            timeval_min_sec(&tv, filter_sample_time);
+        if(kernel_routes_changed || kernel_addr_changed ||
+           kernel_rules_changed)
+            timeval_min(&tv, &kernel_check_time);
         timeval_min(&tv, &resend_time);
+        timeval_min(&tv, &unfeasible_request_time);
+        timeval_min(&tv, &receive_backlog_time);
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
                 continue;
@@ -599,10 +685,22 @@ main(int argc, char **argv)
             timeval_min(&tv, &ifp->hello_timeout);
             timeval_min(&tv, &ifp->update_timeout);
             timeval_min(&tv, &ifp->update_flush_timeout);
+            if(ifp->flush_urgent)
+                urgent = 1;
         }
         timeval_min(&tv, &unicast_flush_timeout);
+        if(timer_slack > 0 && !urgent)
+            align_timeout(&tv, timer_slack);
+        /* If housekeeping is in progress, or deferred packets can be
+           processed, poll for input and resume immediately. */
+        pending = interfaces_pending || routes_pending ||
+            resend_pending || sources_pending ||
+            (receive_backlog_time.tv_sec != 0 &&
+             timeval_compare(&receive_backlog_time, &now) <= 0);
+        if(pending)
+            tv = now;
         FD_ZERO(&readfds);
-        if(timeval_compare(&tv, &now) > 0) {
+        if(pending || timeval_compare(&tv, &now) > 0) {
             int maxfd = 0;
             timeval_minus(&tv, &tv, &now);
             FD_SET(protocol_socket, &readfds);
@@ -632,9 +730,12 @@ main(int argc, char **argv)
                 rc = 0;
                 FD_ZERO(&readfds);
             }
+            slept = !pending;
         }
 
         gettime(&now);
+        if(slept)
+            count_wakeup();
 
         if(exiting)
             break;
@@ -662,8 +763,8 @@ main(int argc, char **argv)
                     if(!if_up(ifp))
                         continue;
                     if(ifp->ifindex == sin6.sin6_scope_id) {
-                        parse_packet((unsigned char*)&sin6.sin6_addr, ifp,
-                                     receive_buffer, rc);
+                        receive_packet((unsigned char*)&sin6.sin6_addr, ifp,
+                                       receive_buffer, rc);
                         VALGRIND_MAKE_MEM_UNDEFINED(receive_buffer,
                                                     receive_buffer_size);
                         break;
@@ -694,6 +795,19 @@ main(int argc, char **argv)
         }
 #endif
 
+        if(handoff_requested) {
+            handoff_requested = 0;
+            rc = handoff_start(argv);
+            if(rc > 0) {
+                handed_off = 1;
+                break;
+            }
+            /* We are the copy of the old instance that was handing over. */
+            if(rc == 0)
+                write_pidfile(O_TRUNC);
+            fprintf(stderr, "Upgrade failed, carrying on.\n");
+        }
+
         if(reopening) {
             kernel_dump_time = now.tv_sec;
             check_neighbours_timeout = now;
@@ -706,21 +820,23 @@ main(int argc, char **argv)
             reopening = 0;
         }
 
-        if(kernel_link_changed || kernel_addr_changed) {
-            check_interfaces();
-            kernel_link_changed = 0;
+        if(kernel_link_changed || kernel_ifaddr_changed) {
+            check_interfaces(0);
+            interfaces_pending = 0;
+            kernel_link_changed = kernel_ifaddr_changed = 0;
         }
 
-        if(kernel_routes_changed || kernel_addr_changed ||
-           kernel_rules_changed || now.tv_sec >= kernel_dump_time) {
-            rc = check_xroutes(1);
+        if(((kernel_routes_changed || kernel_addr_changed ||
+             kernel_rules_changed) &&
+            timeval_compare(&kernel_check_time, &now) <= 0) ||
+           now.tv_sec >= kernel_dump_time) {
+            rc = check_xroutes(1, 1);
             if(rc < 0)
                 fprintf(stderr, "Warning: couldn't check exported routes.\n");
-            rc = check_rules();
-            if(rc < 0)
-                fprintf(stderr, "Warning: couldn't check rules.\n");
             kernel_routes_changed = kernel_rules_changed =
                 kernel_addr_changed = 0;
+            timeval_add_msec(&kernel_check_time, &now,
+                             KERNEL_CHECK_INTERVAL);
             if(kernel_socket >= 0)
                 kernel_dump_time = now.tv_sec + roughly(300);
             else
@@ -736,28 +852,50 @@ main(int argc, char **argv)
         }
 
         if(timeval_compare(&check_interfaces_timeout, &now) < 0) {
-            check_interfaces();
+            interfaces_pending = 1;
             schedule_interfaces_check(30000, 1);
         }
 
+        if(interfaces_pending)
+            interfaces_pending = check_interfaces(housekeeping_budget);
+
         if(now.tv_sec >= expiry_time) {
-            expire_routes();
-            expire_resend();
+            routes_pending = resend_pending = 1;
             expiry_time = now.tv_sec + roughly(30);
         }
 
+        if(routes_pending)
+            routes_pending = expire_routes(housekeeping_budget);
+        else if(resend_pending)
+            resend_pending = expire_resend(housekeeping_budget);
+
         if(now.tv_sec >= source_expiry_time) {
-            expire_sources();
+            sources_pending = 1;
             source_expiry_time = now.tv_sec + roughly(300);
         }
 
+        if(sources_pending)
+            sources_pending = expire_sources(housekeeping_budget);
+
+        if(now.tv_sec >= damping_time) {
+            check_damping();
+            damping_time = now.tv_sec + roughly(5);
+        }
+
+        if(filter_sample_time >= 0 && now.tv_sec >= filter_sample_time) {
+            rc = kernel_sample_filter();
+            filter_sample_time = rc < 0 ? -1 : now.tv_sec + rc;
+        }
+
         FOR_ALL_INTERFACES(ifp) {
             if(!if_up(ifp))
                 continue;
             if(timeval_compare(&now, &ifp->hello_timeout) >= 0)
                 send_hello(ifp);
-            if(timeval_compare(&now, &ifp->update_timeout) >= 0)
-                send_update(ifp, 0, NULL, 0, NULL, 0);
+            if(timeval_compare(&now, &ifp->update_timeout) >= 0) {
+                if(!digest_periodic_update(ifp))
+                    send_update(ifp, 0, NULL, 0, NULL, 0);
+            }
             if(timeval_compare(&now, &ifp->update_flush_timeout) >= 0)
                 flushupdates(ifp);
         }
@@ -767,8 +905,38 @@ main(int argc, char **argv)
                 do_resend();
         }
 
+        if(unfeasible_request_time.tv_sec != 0) {
+            if(timeval_compare(&now, &unfeasible_request_time) >= 0)
+                send_unfeasible_requests();
+        }
+
+        if(receive_backlog_time.tv_sec != 0) {
+            if(timeval_compare(&now, &receive_backlog_time) >= 0)
+                process_receive_backlog();
+        }
+
+        /* With timer slack, once a buffer is due, also send the buffers
+           that would be due within the slack, since we're awake anyway.
+           The others keep their jitter. */
+        flush_limit = now;
+        if(timer_slack > 0) {
+            int due = 0;
+            if(unicast_flush_timeout.tv_sec != 0 &&
+               timeval_compare(&now, &unicast_flush_timeout) >= 0)
+                due = 1;
+            FOR_ALL_INTERFACES(ifp) {
+                if(!if_up(ifp))
+                    continue;
+                if(ifp->flush_timeout.tv_sec != 0 &&
+                   timeval_compare(&now, &ifp->flush_timeout) >= 0)
+                    due = 1;
+            }
+            if(due)
+                timeval_add_msec(&flush_limit, &now, timer_slack);
+        }
+
         if(unicast_flush_timeout.tv_sec != 0) {
-            if(timeval_compare(&now, &unicast_flush_timeout) >= 0)
+            if(timeval_compare(&flush_limit, &unicast_flush_timeout) >= 0)
                 flush_unicast(1);
         }
 
@@ -776,7 +944,7 @@ main(int argc, char **argv)
             if(!if_up(ifp))
                 continue;
             if(ifp->flush_timeout.tv_sec != 0) {
-                if(timeval_compare(&now, &ifp->flush_timeout) >= 0)
+                if(timeval_compare(&flush_limit, &ifp->flush_timeout) >= 0)
                     flushbuf(ifp);
             }
         }
@@ -787,6 +955,12 @@ main(int argc, char **argv)
         }
     }
 
+    if(handed_off) {
+        /* The routes, the sockets and the pidfile are no longer ours. */
+        debugf("Handed off to new instance.\n");
+        return 0;
+    }
+
     debugf("Exiting...\n");
     usleep(roughly(10000));
     gettime(&now);
@@ -853,7 +1027,9 @@ main(int argc, char **argv)
             "               "
             "[-h hello] [-H wired_hello] [-z kind[,factor]]\n"
             "               "
-            "[-k metric] [-A metric] [-s] [-l] [-w] [-r] [-u] [-g port]\n"
+            "[-k metric] [-A metric] [-s] [-l] [-w] [-r] [-u]\n"
+            "               "
+            "[-g port] [-G port]\n"
             "               "
             "[-t table] [-T table] [-c file] [-C statement]\n"
             "               "
@@ -864,6 +1040,10 @@ main(int argc, char **argv)
     exit(1);
 
  fail:
+    /* Until the handoff completes, everything belongs to the old
+       instance. */
+    if(handoff_fd >= 0)
+        goto fail_pid;
     FOR_ALL_INTERFACES(ifp) {
         if(!if_up(ifp))
             continue;
@@ -872,11 +1052,48 @@ main(int argc, char **argv)
     kernel_setup_socket(0);
     kernel_setup(0);
  fail_pid:
-    if(pidfile)
+    if(pidfile && handoff_fd < 0)
         unlink(pidfile);
+    handoff_give_back(argv);
     exit(1);
 }
 
+static int
+write_pidfile(int flags)
+{
+    int pfd, len, rc;
+    char buf[100];
+
+    if(pidfile == NULL || pidfile[0] == '\0')
+        return 0;
+
+    len = snprintf(buf, 100, "%lu", (unsigned long)getpid());
+    if(len < 0 || len >= 100) {
+        perror("snprintf(getpid)");
+        return -1;
+    }
+
+    pfd = open(pidfile, O_WRONLY | O_CREAT | flags, 0644);
+    if(pfd < 0) {
+        char buf[40];
+        snprintf(buf, 40, "creat(%s)", pidfile);
+        buf[39] = '\0';
+        perror(buf);
+        return -1;
+    }
+
+    rc = write(pfd, buf, len);
+    if(rc < len) {
+        perror("write(pidfile)");
+        close(pfd);
+        unlink(pidfile);
+        return -1;
+    }
+
+    close(pfd);
+    return 1;
+}
+
 static int
 accept_local_connections(fd_set *readfds)
 {
@@ -1020,6 +1237,14 @@ init_signals(void)
     sa.sa_flags = 0;
     sigaction(SIGPIPE, &sa, NULL);
 
+    /* After an upgrade, the previous instance is our child, and must not
+       linger as a zombie once it has handed over. */
+    sigemptyset(&ss);
+    sa.sa_handler = SIG_IGN;
+    sa.sa_mask = ss;
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+
     sigemptyset(&ss);
     sa.sa_handler = sigdump;
     sa.sa_mask = ss;
@@ -1110,7 +1335,7 @@ dump_tables(FILE *out)
                 "rtt %s rttcost %d chan %d%s.\n",
                 format_address(neigh->address),
                 neigh->ifp->name,
-                neigh->reach,
+                neighbour_reach(neigh),
                 neighbour_rxcost(neigh),
                 neigh->txcost,
                 format_thousands(neigh->rtt),
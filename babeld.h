@@ -87,18 +87,23 @@ extern int default_wireless_hello_interval, default_wired_hello_interval;
 extern int resend_delay;
 extern int random_id;
 extern int skip_kernel_setup;
+extern int housekeeping_budget;
+extern int timer_slack;
+extern int receive_rate;
+extern unsigned int wakeups, wakeup_rate;
 extern int do_daemonise;
 extern const char *logfile, *pidfile, *state_file;
 extern int link_detect;
 extern int all_wireless;
 extern int has_ipv6_subtrees;
+extern int has_v4viav6;
 
 extern unsigned char myid[8];
 extern int have_id;
 
 extern const unsigned char zeroes[16], ones[16];
 
-extern int protocol_port, local_server_port;
+extern int protocol_port, local_server_port, local_server_write;
 extern unsigned char protocol_group[16];
 extern int protocol_socket;
 extern int kernel_socket;
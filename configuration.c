@@ -23,6 +23,9 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <assert.h>
 
@@ -35,10 +38,12 @@ THE SOFTWARE.
 #include "babeld.h"
 #include "util.h"
 #include "interface.h"
+#include "neighbour.h"
 #include "route.h"
 #include "kernel.h"
 #include "configuration.h"
 #include "rule.h"
+#include "damping.h"
 
 struct filter *input_filters = NULL;
 struct filter *output_filters = NULL;
@@ -47,6 +52,15 @@ struct filter *install_filters = NULL;
 struct interface_conf *default_interface_conf = NULL;
 struct interface_conf *interface_confs = NULL;
 
+/* Generated configuration files may have many thousands of lines, so
+   we keep the tail of each list, and index interface configurations by
+   name, in order to parse them in linear time. */
+static struct filter *input_filters_tail = NULL, *output_filters_tail = NULL,
+    *redistribute_filters_tail = NULL, *install_filters_tail = NULL;
+static struct interface_conf *interface_confs_tail = NULL;
+static struct interface_conf **ifconf_hash = NULL;
+static int ifconf_hash_size = 0, ifconf_count = 0;
+
 /* This file implements a recursive descent parser with one character
    lookahead.  The looked-ahead character is returned from most
    functions.
@@ -412,11 +426,21 @@ parse_filter(int c, gnc_t gnc, void *closure, struct filter **filter_return)
             if(table <= 0 || table > INFINITY)
                 goto error;
             filter->action.table = table;
+        } else if(strcmp(token, "summarise") == 0 ||
+                  strcmp(token, "summarize") == 0) {
+            filter->action.summarise = 1;
+            filter->summary_metric = INFINITY;
         } else {
             goto error;
         }
         free(token);
     }
+    /* A summary is announced for the prefix of the filter. */
+    if(filter->action.summarise &&
+       (filter->prefix == NULL || filter->src_prefix != NULL ||
+        filter->action.add_metric != 0))
+        goto error;
+
     if(filter->af == 0) {
         if(filter->plen_le < 128 || filter->plen_ge > 0 ||
            filter->src_plen_le < 128 || filter->src_plen_ge > 0)
@@ -499,6 +523,12 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
             if(c < -1)
                 goto error;
             if_conf->split_horizon = v;
+        } else if(strcmp(token, "v4-via-v6") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->v4viav6 = v;
         } else if(strcmp(token, "channel") == 0) {
             char *t, *end;
 
@@ -527,6 +557,18 @@ parse_anonymous_ifconf(int c, gnc_t gnc, void *closure,
             if(c < -1)
                 goto error;
             if_conf->enable_timestamps = v;
+        } else if(strcmp(token, "enable-digests") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->enable_digests = v;
+        } else if(strcmp(token, "unicast") == 0) {
+            int v;
+            c = getbool(c, &v, gnc, closure);
+            if(c < -1)
+                goto error;
+            if_conf->unicast = v;
         } else if(strcmp(token, "rtt-decay") == 0) {
             int decay;
             c = getint(c, &decay, gnc, closure);
@@ -594,19 +636,15 @@ parse_ifconf(int c, gnc_t gnc, void *closure,
 }
 
 static void
-add_filter(struct filter *filter, struct filter **filters)
+add_filter(struct filter *filter, struct filter **filters,
+           struct filter **tail)
 {
-    if(*filters == NULL) {
-        filter->next = NULL;
+    filter->next = NULL;
+    if(*filters == NULL)
         *filters = filter;
-    } else {
-        struct filter *f;
-        f = *filters;
-        while(f->next)
-            f = f->next;
-        filter->next = NULL;
-        f->next = filter;
-    }
+    else
+        (*tail)->next = filter;
+    *tail = filter;
 }
 
 static void
@@ -630,8 +668,11 @@ merge_ifconf(struct interface_conf *dest,
     MERGE(split_horizon);
     MERGE(lq);
     MERGE(faraway);
+    MERGE(v4viav6);
     MERGE(channel);
     MERGE(enable_timestamps);
+    MERGE(enable_digests);
+    MERGE(unicast);
     MERGE(rtt_decay);
     MERGE(rtt_min);
     MERGE(rtt_max);
@@ -640,27 +681,80 @@ merge_ifconf(struct interface_conf *dest,
 #undef MERGE
 }
 
+static unsigned int
+ifconf_hash_index(const char *ifname, int size)
+{
+    unsigned int h = 5381;
+    while(*ifname)
+        h = h * 33 + (unsigned char)*ifname++;
+    return h % size;
+}
+
+static struct interface_conf **
+find_ifconf_slot(const char *ifname)
+{
+    unsigned int i = ifconf_hash_index(ifname, ifconf_hash_size);
+
+    while(ifconf_hash[i] && strcmp(ifconf_hash[i]->ifname, ifname) != 0)
+        i = (i + 1) % ifconf_hash_size;
+    return &ifconf_hash[i];
+}
+
+static int
+resize_ifconf_hash(int size)
+{
+    struct interface_conf **old = ifconf_hash;
+    int i, old_size = ifconf_hash_size;
+
+    ifconf_hash = calloc(size, sizeof(struct interface_conf*));
+    if(ifconf_hash == NULL) {
+        ifconf_hash = old;
+        return -1;
+    }
+    ifconf_hash_size = size;
+    for(i = 0; i < old_size; i++) {
+        if(old[i])
+            *find_ifconf_slot(old[i]->ifname) = old[i];
+    }
+    free(old);
+    return 1;
+}
+
 static void
 add_ifconf(struct interface_conf *if_conf, struct interface_conf **if_confs)
 {
-    if(*if_confs == NULL) {
-        if_conf->next = NULL;
-        *if_confs = if_conf;
+    struct interface_conf *next = NULL, **slot = NULL;
+
+    if(2 * (ifconf_count + 1) > ifconf_hash_size)
+        resize_ifconf_hash(ifconf_hash_size < 1 ? 16 : 2 * ifconf_hash_size);
+
+    if(2 * (ifconf_count + 1) <= ifconf_hash_size) {
+        slot = find_ifconf_slot(if_conf->ifname);
+        next = *slot;
     } else {
-        struct interface_conf *prev, *next;
-        next = *if_confs;
-        prev = NULL;
-        while(next) {
-            if(strcmp(next->ifname, if_conf->ifname) == 0) {
-                merge_ifconf(next, if_conf, next);
-                free(if_conf);
-                return;
-            }
-            prev = next;
-            next = next->next;
+        /* Out of memory, fall back to a linear search. */
+        for(next = *if_confs; next; next = next->next) {
+            if(strcmp(next->ifname, if_conf->ifname) == 0)
+                break;
         }
-        if_conf->next = NULL;
-        prev->next = if_conf;
+    }
+
+    if(next) {
+        merge_ifconf(next, if_conf, next);
+        free(if_conf->ifname);
+        free(if_conf);
+        return;
+    }
+
+    if_conf->next = NULL;
+    if(*if_confs == NULL)
+        *if_confs = if_conf;
+    else
+        interface_confs_tail->next = if_conf;
+    interface_confs_tail = if_conf;
+    if(slot) {
+        *slot = if_conf;
+        ifconf_count++;
     }
 }
 
@@ -672,6 +766,7 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
        strcmp(token, "allow-duplicates") == 0 ||
 #ifndef NO_LOCAL_INTERFACE
        strcmp(token, "local-port") == 0 ||
+       strcmp(token, "local-port-readwrite") == 0 ||
 #endif
        strcmp(token, "export-table") == 0 ||
        strcmp(token, "import-table") == 0) {
@@ -687,8 +782,13 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         else if(strcmp(token, "allow_duplicates") == 0)
             allow_duplicates = v;
 #ifndef NO_LOCAL_INTERFACE
-        else if(strcmp(token, "local-port") == 0)
+        else if(strcmp(token, "local-port") == 0) {
+            local_server_port = v;
+            local_server_write = 0;
+        } else if(strcmp(token, "local-port-readwrite") == 0) {
             local_server_port = v;
+            local_server_write = 1;
+        }
 #endif
         else if(strcmp(token, "export-table") == 0)
             export_table = v;
@@ -702,7 +802,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
               strcmp(token, "daemonise") == 0 ||
               strcmp(token, "skip-kernel-setup") == 0 ||
               strcmp(token, "ipv6-subtrees") == 0 ||
-              strcmp(token, "reflect-kernel-metric") == 0) {
+              strcmp(token, "reflect-kernel-metric") == 0 ||
+              strcmp(token, "resolve-neighbours") == 0) {
         int b;
         c = getbool(c, &b, gnc, closure);
         if(c < -1)
@@ -722,6 +823,8 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
             has_ipv6_subtrees = b;
         else if(strcmp(token, "reflect-kernel-metric") == 0)
             reflect_kernel_metric = b;
+        else if(strcmp(token, "resolve-neighbours") == 0)
+            resolve_neighbours = b;
         else
             abort();
     } else if(strcmp(token, "protocol-group") == 0) {
@@ -773,6 +876,42 @@ parse_option(int c, gnc_t gnc, void *closure, char *token)
         if(c < -1 || f < 0 || f > 256)
             goto error;
         diversity_factor = f;
+    } else if(strcmp(token, "housekeeping-budget") == 0) {
+        int b;
+        c = getint(c, &b, gnc, closure);
+        if(c < -1 || b < 0)
+            goto error;
+        housekeeping_budget = b;
+    } else if(strcmp(token, "timer-slack") == 0) {
+        int t;
+        c = getint(c, &t, gnc, closure);
+        if(c < -1 || t < 0 || t > 10000)
+            goto error;
+        timer_slack = t;
+    } else if(strcmp(token, "receive-rate") == 0) {
+        int r;
+        c = getint(c, &r, gnc, closure);
+        if(c < -1 || r < 0 || r > 1000000)
+            goto error;
+        receive_rate = r;
+    } else if(strcmp(token, "damping-half-life") == 0) {
+        int h;
+        c = getint(c, &h, gnc, closure);
+        if(c < -1 || h < 0 || h > 3600)
+            goto error;
+        damping_half_life = h;
+    } else if(strcmp(token, "damping-suppress") == 0) {
+        int p;
+        c = getint(c, &p, gnc, closure);
+        if(c < -1 || p <= 0 || p > DAMPING_MAX_PENALTY)
+            goto error;
+        damping_suppress = p;
+    } else if(strcmp(token, "damping-reuse") == 0) {
+        int p;
+        c = getint(c, &p, gnc, closure);
+        if(c < -1 || p <= 0 || p > DAMPING_MAX_PENALTY)
+            goto error;
+        damping_reuse = p;
     } else if(strcmp(token, "smoothing-half-life") == 0) {
         int h;
         c = getint(c, &h, gnc, closure);
@@ -842,25 +981,26 @@ parse_config(gnc_t gnc, void *closure)
             c = parse_filter(c, gnc, closure, &filter);
             if(c < -1)
                 return -1;
-            add_filter(filter, &input_filters);
+            add_filter(filter, &input_filters, &input_filters_tail);
         } else if(strcmp(token, "out") == 0) {
             struct filter *filter;
             c = parse_filter(c, gnc, closure, &filter);
             if(c < -1)
                 return -1;
-            add_filter(filter, &output_filters);
+            add_filter(filter, &output_filters, &output_filters_tail);
         } else if(strcmp(token, "redistribute") == 0) {
             struct filter *filter;
             c = parse_filter(c, gnc, closure, &filter);
             if(c < -1)
                 return -1;
-            add_filter(filter, &redistribute_filters);
+            add_filter(filter, &redistribute_filters,
+                       &redistribute_filters_tail);
         } else if(strcmp(token, "install") == 0) {
             struct filter *filter;
             c = parse_filter(c, gnc, closure, &filter);
             if(c < -1)
                 return -1;
-            add_filter(filter, &install_filters);
+            add_filter(filter, &install_filters, &install_filters_tail);
         } else if(strcmp(token, "interface") == 0) {
             struct interface_conf *if_conf;
             c = parse_ifconf(c, gnc, closure, &if_conf);
@@ -890,15 +1030,29 @@ parse_config(gnc_t gnc, void *closure)
 }
 
 struct file_state {
-    FILE *f;
+    int fd;
     int line;
+    int pos, len;
+    unsigned char buf[16384];
 };
 
 static int
 gnc_file(struct file_state *s)
 {
     int c;
-    c = fgetc(s->f);
+
+    if(s->pos >= s->len) {
+        int rc;
+        do {
+            rc = read(s->fd, s->buf, sizeof(s->buf));
+        } while(rc < 0 && errno == EINTR);
+        if(rc <= 0)
+            return -1;
+        s->pos = 0;
+        s->len = rc;
+    }
+
+    c = s->buf[s->pos++];
     if(c == '\n')
         s->line++;
     return c;
@@ -907,19 +1061,29 @@ gnc_file(struct file_state *s)
 int
 parse_config_from_file(const char *filename, int *line_return)
 {
-    struct file_state s = { NULL, 1 };
+    struct file_state *s;
     int rc;
 
-    s.f = fopen(filename, "r");
-    if(s.f == NULL) {
+    s = malloc(sizeof(struct file_state));
+    if(s == NULL) {
+        *line_return = 0;
+        return -1;
+    }
+
+    s->fd = open(filename, O_RDONLY);
+    if(s->fd < 0) {
+        free(s);
         *line_return = 0;
         return -1;
     }
+    s->line = 1;
+    s->pos = s->len = 0;
 
-    rc = parse_config((gnc_t)gnc_file, &s);
-    fclose(s.f);
+    rc = parse_config((gnc_t)gnc_file, s);
+    close(s->fd);
 
-    *line_return = s.line;
+    *line_return = s->line;
+    free(s);
     return rc;
 }
 
@@ -961,6 +1125,7 @@ renumber_filters()
     renumber_filter(output_filters);
     renumber_filter(redistribute_filters);
     renumber_filter(install_filters);
+    summary_changed(NULL, 0);
 }
 
 static int
@@ -1029,6 +1194,21 @@ filter_match(struct filter *f, const unsigned char *id,
     return 1;
 }
 
+static struct filter *
+find_filter(struct filter *f, const unsigned char *id,
+            const unsigned char *prefix, unsigned short plen,
+            const unsigned char *src_prefix, unsigned short src_plen,
+            const unsigned char *neigh, unsigned int ifindex, int proto)
+{
+    while(f) {
+        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
+                        neigh, ifindex, proto))
+            return f;
+        f = f->next;
+    }
+    return NULL;
+}
+
 static int
 do_filter(struct filter *f, const unsigned char *id,
           const unsigned char *prefix, unsigned short plen,
@@ -1039,17 +1219,14 @@ do_filter(struct filter *f, const unsigned char *id,
     if(result)
         memset(result, 0, sizeof(struct filter_result));
 
-    while(f) {
-        if(filter_match(f, id, prefix, plen, src_prefix, src_plen,
-                        neigh, ifindex, proto)) {
-            if(result)
-                memcpy(result, &f->action, sizeof(struct filter_result));
-            return f->action.add_metric;
-        }
-        f = f->next;
-    }
+    f = find_filter(f, id, prefix, plen, src_prefix, src_plen,
+                    neigh, ifindex, proto);
+    if(f == NULL)
+        return -1;
 
-    return -1;
+    if(result)
+        memcpy(result, &f->action, sizeof(struct filter_result));
+    return f->action.add_metric;
 }
 
 int
@@ -1080,6 +1257,64 @@ output_filter(const unsigned char *id,
     return res;
 }
 
+/* Returns the summarising output filter that replaces the announcement
+   of a route on the given interface, either because the route is one of
+   the components of the summary or because it is the summary itself. */
+struct filter *
+summary_filter(const unsigned char *id,
+               const unsigned char *prefix, unsigned short plen,
+               const unsigned char *src_prefix, unsigned short src_plen,
+               unsigned int ifindex)
+{
+    struct filter *f;
+
+    if(src_plen != 0)
+        return NULL;
+
+    f = find_filter(output_filters, id, prefix, plen, src_prefix, src_plen,
+                    NULL, ifindex, 0);
+    if(f && f->action.summarise)
+        return f;
+
+    for(f = output_filters; f; f = f->next) {
+        if(f->action.summarise && f->plen == plen &&
+           memcmp(f->prefix, prefix, 16) == 0 &&
+           (!f->ifname || (f->ifindex && f->ifindex == ifindex)))
+            return f;
+    }
+    return NULL;
+}
+
+int
+have_summaries(unsigned int ifindex)
+{
+    struct filter *f;
+
+    for(f = output_filters; f; f = f->next) {
+        if(f->action.summarise &&
+           (!f->ifname || (f->ifindex && f->ifindex == ifindex)))
+            return 1;
+    }
+    return 0;
+}
+
+/* Called when a route within prefix changes, or with prefix NULL when
+   anything else that summaries depend on changes. */
+void
+summary_changed(const unsigned char *prefix, unsigned char plen)
+{
+    struct filter *f;
+
+    for(f = output_filters; f; f = f->next) {
+        if(!f->action.summarise)
+            continue;
+        if(prefix == NULL ||
+           (plen >= f->plen ? in_prefix(prefix, f->prefix, f->plen) :
+            in_prefix(f->prefix, prefix, plen)))
+            f->summary_generation++;
+    }
+}
+
 int
 redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     const unsigned char *src_prefix, unsigned short src_plen,
@@ -1117,7 +1352,7 @@ finalise_config()
     filter->proto = RTPROT_BABEL_LOCAL;
     filter->plen_le = 128;
     filter->src_plen_le = 128;
-    add_filter(filter, &redistribute_filters);
+    add_filter(filter, &redistribute_filters, &redistribute_filters_tail);
 
     while(interface_confs) {
         struct interface_conf *if_conf;
@@ -1134,5 +1369,11 @@ finalise_config()
         }
     }
 
+    /* The configurations now belong to the interfaces. */
+    free(ifconf_hash);
+    ifconf_hash = NULL;
+    ifconf_hash_size = ifconf_count = 0;
+    interface_confs_tail = NULL;
+
     return 1;
 }
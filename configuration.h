@@ -25,8 +25,11 @@ struct filter_result {
     unsigned char *src_prefix;
     unsigned char src_plen;
     unsigned int table;
+    unsigned char summarise;
 };
 
+struct summary_state;
+
 struct filter {
     int af;
     char *ifname;
@@ -41,6 +44,14 @@ struct filter {
     unsigned char *neigh;
     int proto;                  /* May be negative */
     struct filter_result action;
+    /* For summarising output filters, the smallest metric that we
+       announced for the summary with seqno summary_seqno, and the
+       components cached for each interface, which are valid as long as
+       summary_generation doesn't change. */
+    unsigned short summary_seqno;
+    unsigned short summary_metric;
+    unsigned int summary_generation;
+    struct summary_state *summary_states;
     struct filter *next;
 };
 
@@ -58,6 +69,13 @@ int output_filter(const unsigned char *id,
                   const unsigned char *prefix, unsigned short plen,
                   const unsigned char *src_prefix, unsigned short src_plen,
                   unsigned int ifindex);
+struct filter *summary_filter(const unsigned char *id,
+                             const unsigned char *prefix, unsigned short plen,
+                             const unsigned char *src_prefix,
+                             unsigned short src_plen,
+                             unsigned int ifindex);
+int have_summaries(unsigned int ifindex);
+void summary_changed(const unsigned char *prefix, unsigned char plen);
 int redistribute_filter(const unsigned char *prefix, unsigned short plen,
                     const unsigned char *src_prefix, unsigned short src_plen,
                     unsigned int ifindex, int proto,
@@ -0,0 +1,230 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "babeld.h"
+#include "util.h"
+#include "interface.h"
+#include "message.h"
+#include "damping.h"
+
+/* Disabled by default. */
+int damping_half_life = 0;
+int damping_suppress = 2000;
+int damping_reuse = 750;
+
+/* Sorted by prefix, like the source table. */
+static struct damping *dampings = NULL;
+static int numdampings = 0, maxdampings = 0;
+
+static int
+damping_compare(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen,
+                const struct damping *d)
+{
+    int rc;
+
+    if(plen != d->plen)
+        return plen < d->plen ? -1 : 1;
+    rc = memcmp(prefix, d->prefix, 16);
+    if(rc != 0)
+        return rc;
+    if(src_plen != d->src_plen)
+        return src_plen < d->src_plen ? -1 : 1;
+    return memcmp(src_prefix, d->src_prefix, 16);
+}
+
+static struct damping *
+find_damping(const unsigned char *prefix, unsigned char plen,
+             const unsigned char *src_prefix, unsigned char src_plen,
+             int create)
+{
+    int p = 0, g = numdampings - 1, m, c;
+    struct damping *d;
+
+    while(p <= g) {
+        m = (p + g) / 2;
+        c = damping_compare(prefix, plen, src_prefix, src_plen, &dampings[m]);
+        if(c == 0)
+            return &dampings[m];
+        else if(c < 0)
+            g = m - 1;
+        else
+            p = m + 1;
+    }
+
+    if(!create)
+        return NULL;
+
+    if(numdampings >= maxdampings) {
+        int n = maxdampings < 1 ? 8 : 2 * maxdampings;
+        struct damping *new_dampings =
+            realloc(dampings, n * sizeof(struct damping));
+        if(new_dampings == NULL) {
+            perror("realloc(dampings)");
+            return NULL;
+        }
+        dampings = new_dampings;
+        maxdampings = n;
+    }
+
+    if(p < numdampings)
+        memmove(dampings + p + 1, dampings + p,
+                (numdampings - p) * sizeof(struct damping));
+    numdampings++;
+
+    d = &dampings[p];
+    memset(d, 0, sizeof(struct damping));
+    memcpy(d->prefix, prefix, 16);
+    d->plen = plen;
+    memcpy(d->src_prefix, src_prefix, 16);
+    d->src_plen = src_plen;
+    d->time = now.tv_sec;
+    return d;
+}
+
+/* Exponential decay: halve for every half-life, and approximate 2^-x
+   by 1 - x/2 for the remaining fraction. */
+static unsigned int
+decayed_penalty(struct damping *d)
+{
+    time_t dt = now.tv_sec - d->time;
+    unsigned int penalty = d->penalty;
+
+    if(dt <= 0)
+        return penalty;
+    if(dt >= 16 * damping_half_life)
+        return 0;
+    penalty >>= dt / damping_half_life;
+    dt %= damping_half_life;
+    return penalty - penalty * dt / (2 * damping_half_life);
+}
+
+/* Record that we are about to send a triggered update for a prefix.
+   Returns 1 if the update should be suppressed, which we only do when
+   the caller says it's safe. */
+int
+damp_update(const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen,
+            int suppressible)
+{
+    struct damping *d;
+
+    if(damping_half_life <= 0)
+        return 0;
+
+    d = find_damping(prefix, plen, src_prefix, src_plen, 1);
+    if(d == NULL)
+        return 0;
+
+    d->penalty = MIN(decayed_penalty(d) + DAMPING_PENALTY,
+                     DAMPING_MAX_PENALTY);
+    d->time = now.tv_sec;
+
+    if(!d->suppressed && d->penalty >= damping_suppress) {
+        debugf("Suppressing updates for %s (penalty %d).\n",
+               format_prefix(prefix, plen), d->penalty);
+        d->suppressed = 1;
+    }
+
+    if(d->suppressed && suppressible) {
+        d->pending = 1;
+        return 1;
+    }
+
+    /* This update carries whatever we were holding back. */
+    d->pending = 0;
+    return 0;
+}
+
+/* Decay penalties, send the updates that were held back for prefixes
+   that are reused, and forget about prefixes that have calmed down. */
+void
+check_damping()
+{
+    int i, j = 0;
+
+    for(i = 0; i < numdampings; i++) {
+        struct damping *d = &dampings[i];
+
+        d->penalty = damping_half_life > 0 ? decayed_penalty(d) : 0;
+        d->time = now.tv_sec;
+
+        if(d->suppressed && d->penalty < damping_reuse) {
+            debugf("Reusing %s.\n", format_prefix(d->prefix, d->plen));
+            d->suppressed = 0;
+            if(d->pending)
+                send_update(NULL, 0, d->prefix, d->plen,
+                            d->src_prefix, d->src_plen);
+            d->pending = 0;
+        }
+
+        if(!d->suppressed && d->penalty < DAMPING_PENALTY / 8)
+            continue;
+
+        if(j < i)
+            dampings[j] = *d;
+        j++;
+    }
+    numdampings = j;
+
+    if(numdampings == 0 && maxdampings > 0) {
+        free(dampings);
+        dampings = NULL;
+        maxdampings = 0;
+    }
+}
+
+struct damping_stream {
+    int index;
+};
+
+struct damping_stream *
+damping_stream()
+{
+    struct damping_stream *stream = malloc(sizeof(struct damping_stream));
+    if(stream == NULL)
+        return NULL;
+
+    stream->index = 0;
+    return stream;
+}
+
+struct damping *
+damping_stream_next(struct damping_stream *stream)
+{
+    if(stream->index < numdampings)
+        return &dampings[stream->index++];
+    else
+        return NULL;
+}
+
+void
+damping_stream_done(struct damping_stream *stream)
+{
+    free(stream);
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Penalties are in units of DAMPING_PENALTY per flap, as in RFC 2439. */
+#define DAMPING_PENALTY 1000
+#define DAMPING_MAX_PENALTY 16000
+
+struct damping {
+    unsigned char prefix[16];
+    unsigned char plen;
+    unsigned char src_prefix[16];
+    unsigned char src_plen;
+    unsigned short penalty;
+    time_t time;
+    /* Non-urgent updates are not being sent. */
+    char suppressed;
+    /* An update was suppressed, send one when we're reused. */
+    char pending;
+};
+
+struct damping_stream;
+
+extern int damping_half_life, damping_suppress, damping_reuse;
+
+int damp_update(const unsigned char *prefix, unsigned char plen,
+                const unsigned char *src_prefix, unsigned char src_plen,
+                int suppressible);
+void check_damping(void);
+struct damping_stream *damping_stream(void);
+struct damping *damping_stream_next(struct damping_stream *stream);
+void damping_stream_done(struct damping_stream *stream);
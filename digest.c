@@ -0,0 +1,478 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "babeld.h"
+#include "util.h"
+#include "interface.h"
+#include "neighbour.h"
+#include "source.h"
+#include "route.h"
+#include "kernel.h"
+#include "xroute.h"
+#include "message.h"
+#include "configuration.h"
+#include "digest.h"
+
+/* The digest of a node is the sum of the digests of its children, so
+   that it doesn't depend on the order in which routes are walked.  The
+   digest of a route covers its prefix, router-id and seqno; metrics
+   are not covered, changes to those are sent as triggered updates. */
+
+/* Bumped whenever a route, an xroute or the router-id of a neighbour
+   changes, which invalidates the leaves cached in interfaces and
+   neighbours. */
+static unsigned int digest_generation = 1;
+
+void
+digest_changed(void)
+{
+    digest_generation++;
+    if(digest_generation == 0)
+        digest_generation = 1;
+}
+
+/* A neighbour doesn't keep routes with its own router-id, so routes
+   with the router-id of any node on the link are left out of digests,
+   and are sent with periodic updates instead. */
+static int
+digest_excluded(struct interface *ifp, const unsigned char *id,
+                struct neighbour *except)
+{
+    struct neighbour *neigh;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp == ifp && neigh != except && neigh->digest &&
+           memcmp(neigh->digest_id, id, 8) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static unsigned int
+fnv(unsigned int h, const unsigned char *p, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+static int
+digest_leaf(const unsigned char *prefix, unsigned char plen,
+            const unsigned char *src_prefix, unsigned char src_plen,
+            unsigned int *key_r)
+{
+    unsigned int h = 2166136261U;
+    h = fnv(h, prefix, 16);
+    h = fnv(h, &plen, 1);
+    if(src_plen != 0) {
+        h = fnv(h, src_prefix, 16);
+        h = fnv(h, &src_plen, 1);
+    }
+    *key_r = h;
+    return h >> 24;
+}
+
+static unsigned int
+digest_entry(unsigned int key, const unsigned char *id, unsigned short seqno)
+{
+    unsigned char s[2];
+    DO_HTONS(s, seqno);
+    return fnv(fnv(key, id, 8), s, 2);
+}
+
+static void
+digest_account(struct interface *ifp, unsigned int *digests,
+               const unsigned char *resend, const unsigned char *id,
+               const unsigned char *prefix, unsigned char plen,
+               const unsigned char *src_prefix, unsigned char src_plen,
+               unsigned short seqno, unsigned short metric)
+{
+    unsigned int key;
+    int leaf, add_metric;
+
+    /* See really_send_update. */
+    if(plen >= 96 && v4mapped(prefix) && !ifp->ipv4 &&
+       IF_CONF(ifp, v4viav6) == CONFIG_NO)
+        return;
+
+    add_metric = output_filter(id, prefix, plen, src_prefix, src_plen,
+                               ifp->ifindex);
+    if(add_metric >= INFINITY)
+        return;
+
+    leaf = digest_leaf(prefix, plen, src_prefix, src_plen, &key);
+    if(digests && metric + add_metric < INFINITY)
+        digests[leaf] += digest_entry(key, id, seqno);
+    if(resend && resend[leaf])
+        send_update(ifp, 0, prefix, plen, src_prefix, src_plen);
+}
+
+/* Walk the routes that flushupdates would announce on ifp.  Reachable
+   routes are added to the leaf digests if digests is not NULL; routes
+   that fall into a leaf set in resend are scheduled for sending, even
+   when they are retractions. */
+static void
+digest_walk(struct interface *ifp, unsigned int *digests,
+            const unsigned char *resend)
+{
+    struct xroute_stream *xroutes;
+    struct route_stream *routes;
+
+    if(digests)
+        memset(digests, 0, DIGEST_LEAVES * sizeof(unsigned int));
+
+    xroutes = xroute_stream();
+    if(xroutes) {
+        while(1) {
+            struct xroute *xroute = xroute_stream_next(xroutes);
+            struct babel_route *route;
+            if(xroute == NULL)
+                break;
+            route = find_installed_route(xroute->prefix, xroute->plen,
+                                         xroute->src_prefix,
+                                         xroute->src_plen);
+            if(route && xroute->metric > kernel_metric)
+                continue;
+            digest_account(ifp, digests, resend, myid,
+                           xroute->prefix, xroute->plen,
+                           xroute->src_prefix, xroute->src_plen,
+                           myseqno, xroute->metric);
+        }
+        xroute_stream_done(xroutes);
+    } else {
+        fprintf(stderr, "Couldn't allocate xroute stream.\n");
+    }
+
+    routes = route_stream(ROUTE_INSTALLED);
+    if(routes) {
+        while(1) {
+            struct babel_route *route = route_stream_next(routes);
+            struct xroute *xroute;
+            struct source *src;
+            if(route == NULL)
+                break;
+            src = route->src;
+            xroute = find_xroute(src->prefix, src->plen,
+                                 src->src_prefix, src->src_plen);
+            if(xroute && xroute->metric <= kernel_metric)
+                continue;
+            if((ifp->flags & IF_SPLIT_HORIZON) && route->neigh->ifp == ifp)
+                continue;
+            if(digest_excluded(ifp, src->id, NULL))
+                continue;
+            digest_account(ifp, digests, resend, src->id,
+                           src->prefix, src->plen,
+                           src->src_prefix, src->src_plen,
+                           route->seqno,
+                           route_interferes(route, ifp) ?
+                           route_metric(route) :
+                           route_metric_noninterfering(route));
+        }
+        route_stream_done(routes);
+    } else {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+    }
+}
+
+/* Our view of what neigh announces to us. */
+static void
+digest_neighbour(struct neighbour *neigh, unsigned int *digests)
+{
+    struct route_stream *routes;
+
+    memset(digests, 0, DIGEST_LEAVES * sizeof(unsigned int));
+
+    routes = route_stream(ROUTE_ALL);
+    if(routes == NULL) {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+        return;
+    }
+    while(1) {
+        struct babel_route *route = route_stream_next(routes);
+        struct source *src;
+        unsigned int key;
+        int leaf;
+        if(route == NULL)
+            break;
+        if(route->neigh != neigh || route->refmetric >= INFINITY)
+            continue;
+        src = route->src;
+        if(digest_excluded(neigh->ifp, src->id, neigh))
+            continue;
+        leaf = digest_leaf(src->prefix, src->plen,
+                           src->src_prefix, src->src_plen, &key);
+        digests[leaf] += digest_entry(key, src->id, route->seqno);
+    }
+    route_stream_done(routes);
+}
+
+/* The leaves of what we announce on ifp and of what neigh announces
+   are recomputed only after something changed. */
+static unsigned int *
+interface_leaves(struct interface *ifp)
+{
+    if(ifp->digest_leaves == NULL) {
+        ifp->digest_leaves = malloc(DIGEST_LEAVES * sizeof(unsigned int));
+        if(ifp->digest_leaves == NULL) {
+            perror("malloc(digest_leaves)");
+            return NULL;
+        }
+        ifp->digest_generation = 0;
+    }
+    if(ifp->digest_generation != digest_generation) {
+        digest_walk(ifp, ifp->digest_leaves, NULL);
+        ifp->digest_generation = digest_generation;
+    }
+    return ifp->digest_leaves;
+}
+
+static unsigned int *
+neighbour_leaves(struct neighbour *neigh)
+{
+    if(neigh->digest_leaves == NULL) {
+        neigh->digest_leaves = malloc(DIGEST_LEAVES * sizeof(unsigned int));
+        if(neigh->digest_leaves == NULL) {
+            perror("malloc(digest_leaves)");
+            return NULL;
+        }
+        neigh->digest_generation = 0;
+    }
+    if(neigh->digest_generation != digest_generation) {
+        digest_neighbour(neigh, neigh->digest_leaves);
+        neigh->digest_generation = digest_generation;
+    }
+    return neigh->digest_leaves;
+}
+
+/* The routes left out of digests still need to be refreshed.  With a
+   single neighbour, they all carry its router-id and it has no use for
+   them. */
+static void
+digest_send_excluded(struct interface *ifp)
+{
+    struct route_stream *routes;
+    struct neighbour *neigh;
+    int n = 0;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp == ifp)
+            n++;
+    }
+    if(n < 2)
+        return;
+
+    routes = route_stream(ROUTE_INSTALLED);
+    if(routes == NULL) {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+        return;
+    }
+    while(1) {
+        struct babel_route *route = route_stream_next(routes);
+        struct source *src;
+        if(route == NULL)
+            break;
+        src = route->src;
+        if((ifp->flags & IF_SPLIT_HORIZON) && route->neigh->ifp == ifp)
+            continue;
+        if(digest_excluded(ifp, src->id, NULL))
+            send_update(ifp, 0, src->prefix, src->plen,
+                        src->src_prefix, src->src_plen);
+    }
+    route_stream_done(routes);
+}
+
+/* The leaves in matched agree with what neigh announces, which is as
+   good as having received the updates again. */
+static void
+digest_refresh(struct neighbour *neigh, const unsigned char *matched)
+{
+    struct route_stream *routes;
+
+    routes = route_stream(ROUTE_ALL);
+    if(routes == NULL) {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+        return;
+    }
+    while(1) {
+        struct babel_route *route = route_stream_next(routes);
+        struct source *src;
+        unsigned int key;
+        if(route == NULL)
+            break;
+        if(route->neigh != neigh || route->refmetric >= INFINITY)
+            continue;
+        src = route->src;
+        if(digest_excluded(neigh->ifp, src->id, neigh))
+            continue;
+        if(!matched[digest_leaf(src->prefix, src->plen,
+                                src->src_prefix, src->src_plen, &key)])
+            continue;
+        if(keep_unfeasible || route_feasible(route))
+            route->time = now.tv_sec;
+    }
+    route_stream_done(routes);
+}
+
+/* Digests are only worthwhile if every neighbour on the link can use
+   them, since the periodic update is multicast. */
+int
+digest_capable(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    int n = 0;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        if(!neigh->digest)
+            return 0;
+        n++;
+    }
+    return n > 0;
+}
+
+/* Called instead of a periodic full update.  Returns 0 if a full
+   update should be sent. */
+int
+digest_periodic_update(struct interface *ifp)
+{
+    if(!(ifp->flags & IF_DIGEST) || !digest_capable(ifp))
+        return 0;
+
+    /* Summaries are not covered by digests. */
+    if(have_summaries(ifp->ifindex))
+        return 0;
+
+    debugf("Sending digest instead of full update on %s.\n", ifp->name);
+    digest_send_excluded(ifp);
+    ifp->digest_pending = 1;
+    set_timeout(&ifp->update_timeout, ifp->update_interval);
+    return 1;
+}
+
+int
+digest_root(struct interface *ifp, unsigned int *digests)
+{
+    unsigned int *leaves;
+    int i, j;
+
+    leaves = interface_leaves(ifp);
+    if(leaves == NULL)
+        return -1;
+    for(i = 0; i < DIGEST_FANOUT; i++) {
+        digests[i] = 0;
+        for(j = 0; j < DIGEST_FANOUT; j++)
+            digests[i] += leaves[i * DIGEST_FANOUT + j];
+    }
+    return 1;
+}
+
+void
+digest_hello_received(struct neighbour *neigh, const unsigned char *node)
+{
+    unsigned int *leaves;
+    unsigned char matched[DIGEST_LEAVES];
+    int i, j;
+
+    if(node[0] != 0 || !(neigh->ifp->flags & IF_DIGEST))
+        return;
+
+    leaves = neighbour_leaves(neigh);
+    if(leaves == NULL)
+        return;
+    memset(matched, 0, sizeof(matched));
+    for(i = 0; i < DIGEST_FANOUT; i++) {
+        unsigned int theirs, ours = 0;
+        DO_NTOHL(theirs, node + 2 + 4 * i);
+        for(j = 0; j < DIGEST_FANOUT; j++)
+            ours += leaves[i * DIGEST_FANOUT + j];
+        if(ours == theirs) {
+            memset(matched + i * DIGEST_FANOUT, 1, DIGEST_FANOUT);
+        } else {
+            debugf("Digest mismatch for bucket %d from %s.\n",
+                   i, format_address(neigh->address));
+            send_digest_request(neigh, i, leaves + i * DIGEST_FANOUT);
+        }
+    }
+    digest_refresh(neigh, matched);
+}
+
+void
+digest_request_received(struct neighbour *neigh, const unsigned char *node)
+{
+    unsigned int *leaves;
+    unsigned char resend[DIGEST_LEAVES];
+    unsigned short mask = 0;
+    int bucket = node[1], j, n = 0;
+
+    if(node[0] != 1 || bucket >= DIGEST_FANOUT)
+        return;
+
+    leaves = interface_leaves(neigh->ifp);
+    if(leaves == NULL)
+        return;
+    memset(resend, 0, sizeof(resend));
+    for(j = 0; j < DIGEST_FANOUT; j++) {
+        unsigned int theirs;
+        DO_NTOHL(theirs, node + 2 + 4 * j);
+        if(theirs == leaves[bucket * DIGEST_FANOUT + j]) {
+            mask |= 1 << j;
+        } else {
+            resend[bucket * DIGEST_FANOUT + j] = 1;
+            n++;
+        }
+    }
+
+    debugf("Digest request for bucket %d from %s, resending %d leaves.\n",
+           bucket, format_address(neigh->address), n);
+    if(n > 0)
+        digest_walk(neigh->ifp, NULL, resend);
+    send_digest_ack(neigh, bucket, mask);
+}
+
+void
+digest_ack_received(struct neighbour *neigh, int bucket, unsigned short mask)
+{
+    unsigned char matched[DIGEST_LEAVES];
+    int j;
+
+    if(bucket >= DIGEST_FANOUT)
+        return;
+
+    memset(matched, 0, sizeof(matched));
+    for(j = 0; j < DIGEST_FANOUT; j++) {
+        if(mask & (1 << j))
+            matched[bucket * DIGEST_FANOUT + j] = 1;
+    }
+    digest_refresh(neigh, matched);
+}
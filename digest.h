@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Anti-entropy digests.  The routes that we announce on an interface
+   are hashed into DIGEST_LEAVES leaves, which are grouped into
+   DIGEST_FANOUT buckets.  A node carries the DIGEST_FANOUT digests of
+   its children; the root (level 0) is carried in Hellos, and a level 1
+   node is carried in a wildcard request for the leaves of a bucket. */
+
+#define DIGEST_FANOUT 16
+#define DIGEST_LEAVES (DIGEST_FANOUT * DIGEST_FANOUT)
+
+/* Length of the body of a sub-TLV carrying a node (level, index,
+   digests) and of the one acknowledging matching leaves (level, index,
+   bitmask).  In Hellos, the sub-TLV starts with the sender's router-id,
+   which is all there is when it only advertises support. */
+#define DIGEST_NODE_LEN (2 + 4 * DIGEST_FANOUT)
+#define DIGEST_ACK_LEN 4
+#define DIGEST_HELLO_LEN 8
+
+void digest_changed(void);
+int digest_capable(struct interface *ifp);
+int digest_periodic_update(struct interface *ifp);
+int digest_root(struct interface *ifp, unsigned int *digests);
+void digest_hello_received(struct neighbour *neigh,
+                           const unsigned char *node);
+void digest_request_received(struct neighbour *neigh,
+                             const unsigned char *node);
+void digest_ack_received(struct neighbour *neigh, int bucket,
+                         unsigned short mask);
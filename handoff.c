@@ -0,0 +1,966 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Upgrading without dropping routes.  The running instance forks, and
+   the parent execs the new binary, so that the process id, which is what
+   supervisors track, doesn't change.  The child keeps a copy of the old
+   state: it passes the sockets to the new instance over a UNIX socket,
+   then streams the state as text, one record per line.  The new
+   instance acknowledges once it has taken everything over, and the
+   child exits without retracting anything.  Should the new instance
+   fail, the child carries on in its place. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "babeld.h"
+#include "util.h"
+#include "kernel.h"
+#include "interface.h"
+#include "source.h"
+#include "neighbour.h"
+#include "route.h"
+#include "message.h"
+#include "resend.h"
+#include "rule.h"
+#include "local.h"
+#include "profile.h"
+#include "handoff.h"
+
+#define HANDOFF_ENV "BABELD_HANDOFF_FD"
+#define HANDOFF_FALLBACK_ENV "BABELD_HANDOFF_FALLBACK"
+#define HANDOFF_VERSION 1
+#define HANDOFF_TIMEOUT 10000
+#define HANDOFF_HEADER_LEN 48
+
+#ifdef NO_LOCAL_INTERFACE
+#define HANDOFF_MAX_FDS 2
+#else
+#define HANDOFF_MAX_FDS (3 + MAX_LOCAL_SOCKETS)
+#endif
+
+int handoff_requested = 0;
+int handoff_fd = -1;
+
+/* The binary to exec, resolved at startup since daemonising changes to
+   the root directory.  NULL if argv[0] is to be looked up in PATH. */
+static char *handoff_binary = NULL;
+
+/* In the new instance, the binary of the old instance, which we exec
+   if we cannot take over; NULL if there is none. */
+static char *handoff_fallback = NULL;
+
+static FILE *handoff_in = NULL;
+/* Whether we have read the whole state sent by the old instance. */
+static int handoff_in_done = 0;
+#ifndef NO_LOCAL_INTERFACE
+static int adopted_sockets[MAX_LOCAL_SOCKETS];
+static int num_adopted_sockets = 0;
+#endif
+
+static int
+set_handoff_timeout(int fd)
+{
+    struct timeval tv;
+    int rc;
+
+    tv.tv_sec = HANDOFF_TIMEOUT / 1000;
+    tv.tv_usec = (HANDOFF_TIMEOUT % 1000) * 1000;
+    rc = setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(rc >= 0)
+        rc = setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return rc;
+}
+
+/* Our sockets are passed explicitly, don't leak the inherited copies
+   into the binary we are about to exec. */
+static void
+close_on_exec_all(int keep)
+{
+    long max = sysconf(_SC_OPEN_MAX);
+    int i;
+
+    if(max < 0 || max > 4096)
+        max = 4096;
+    for(i = 3; i < max; i++) {
+        if(i != keep)
+            fcntl(i, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/* Times are passed relative to now, in milliseconds, since the new
+   instance doesn't necessarily share our idea of the epoch. */
+
+static const char *
+format_age(char *buf, int len, const struct timeval *tv)
+{
+    long long us;
+
+    if(tv->tv_sec == 0 && tv->tv_usec == 0) {
+        snprintf(buf, len, "-");
+    } else {
+        us = (long long)(now.tv_sec - tv->tv_sec) * 1000000 +
+            (now.tv_usec - tv->tv_usec);
+        snprintf(buf, len, "%lld", us / 1000);
+    }
+    return buf;
+}
+
+static void
+parse_age(struct timeval *tv, const char *s)
+{
+    long long us;
+
+    if(strcmp(s, "-") == 0) {
+        tv->tv_sec = 0;
+        tv->tv_usec = 0;
+        return;
+    }
+    us = (long long)now.tv_sec * 1000000 + now.tv_usec - atoll(s) * 1000;
+    /* A zero timeval means unset. */
+    if(us <= 0)
+        us = 1;
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+}
+
+static int
+send_fds(int fd, const char *data, int len, const int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } u;
+    int rc;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&u, 0, sizeof(u));
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+    rc = sendmsg(fd, &msg, 0);
+    if(rc < len)
+        return -1;
+    return 1;
+}
+
+static int
+receive_fds(int fd, char *data, int len, int *fds, int maxfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } u;
+    int rc, n = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    rc = recvmsg(fd, &msg, MSG_WAITALL);
+    if(rc < len)
+        return -1;
+
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if(n + count > maxfds)
+                return -1;
+            memcpy(fds + n, CMSG_DATA(cmsg), count * sizeof(int));
+            n += count;
+        }
+    }
+    if(msg.msg_flags & MSG_CTRUNC)
+        return -1;
+    return n;
+}
+
+static void
+dump_state(FILE *out)
+{
+    struct interface *ifp;
+    struct neighbour *neigh;
+    struct source_stream *sources;
+    struct route_stream *routes;
+    struct resend *resend;
+    const char *name;
+    char t1[30], t2[30], t3[30], t4[30], t5[30];
+    int i, value;
+
+    fprintf(out, "id %s\n", format_eui64(myid));
+    fprintf(out, "seqno %d\n", myseqno);
+    FOR_ALL_INTERFACES(ifp)
+        fprintf(out, "interface %s %d %d %s %s\n", ifp->name,
+                ifp->hello_seqno, ifp->unicast_hello_seqno,
+                format_age(t1, 30, &ifp->hello_timeout),
+                format_age(t2, 30, &ifp->update_timeout));
+    /* The rest is only read once the new instance has its interfaces. */
+    fprintf(out, "resume\n");
+
+    for(i = 0; kernel_saved_setting(i, &name, &value); i++)
+        fprintf(out, "setting %s %d\n", name, value);
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        fprintf(out, "neighbour %s %s %d %hx %d %s %s %d %d %u %s %u %s %d %s "
+                "%d %hx %s %d\n",
+                neigh->ifp->name, format_address(neigh->address),
+                neigh->hello.seqno, neigh->hello.reach, neigh->txcost,
+                format_age(t1, 30, &neigh->hello.time),
+                format_age(t2, 30, &neigh->ihu_time),
+                neigh->hello.interval, neigh->ihu_interval,
+                neigh->hello_send_us,
+                format_age(t3, 30, &neigh->hello_rtt_receive_time),
+                neigh->rtt,
+                format_age(t4, 30, &neigh->rtt_time),
+                neigh->digest, format_eui64(neigh->digest_id),
+                neigh->uhello.seqno, neigh->uhello.reach,
+                format_age(t5, 30, &neigh->uhello.time),
+                neigh->uhello.interval);
+    }
+
+    sources = source_stream();
+    if(sources) {
+        while(1) {
+            struct source *src = source_stream_next(sources);
+            if(src == NULL)
+                break;
+            fprintf(out, "source %s %s %s %d %d %ld\n",
+                    format_eui64(src->id),
+                    format_prefix(src->prefix, src->plen),
+                    format_prefix(src->src_prefix, src->src_plen),
+                    src->seqno, src->metric,
+                    (long)(now.tv_sec - src->time));
+        }
+        source_stream_done(sources);
+    }
+
+    routes = route_stream(ROUTE_ALL);
+    if(routes) {
+        while(1) {
+            struct babel_route *route = route_stream_next(routes);
+            if(route == NULL)
+                break;
+            fprintf(out, "route %s %s %s %s ",
+                    format_prefix(route->src->prefix, route->src->plen),
+                    format_prefix(route->src->src_prefix,
+                                  route->src->src_plen),
+                    format_eui64(route->src->id), route->neigh->ifp->name);
+            fprintf(out, "%s %s %d %d %d %d %d %ld %d %ld %d ",
+                    format_address(route->neigh->address),
+                    format_address(route->nexthop),
+                    route->refmetric, route->cost, route->add_metric,
+                    route->seqno, route->hold_time,
+                    (long)(now.tv_sec - route->time),
+                    route->smoothed_metric,
+                    (long)(now.tv_sec - route->smoothed_metric_time),
+                    route->installed);
+            for(i = 0; i < DIVERSITY_HOPS; i++)
+                fprintf(out, "%02x", route->channels[i]);
+            fprintf(out, "\n");
+        }
+        route_stream_done(routes);
+    }
+
+    for(i = 0; i < SRC_TABLE_NUM; i++) {
+        const unsigned char *src;
+        int plen, table;
+        if(get_rule(i, &src, &plen, &table))
+            fprintf(out, "rule %d %s %d\n", i, format_prefix(src, plen), table);
+    }
+
+    for(resend = to_resend; resend; resend = resend->next) {
+        fprintf(out, "resend %d %s %s %d ",
+                resend->kind,
+                format_prefix(resend->prefix, resend->plen),
+                format_prefix(resend->src_prefix, resend->src_plen),
+                resend->seqno);
+        fprintf(out, "%s %s %d\n",
+                memcmp(resend->id, zeroes, 8) == 0 ?
+                "-" : format_eui64(resend->id),
+                resend->ifp ? resend->ifp->name : "-",
+                resend->delay);
+    }
+
+    fprintf(out, "end\n");
+}
+
+void
+handoff_setup(const char *argv0)
+{
+    char buf[PATH_MAX];
+    ssize_t len;
+
+#ifdef __linux__
+    /* When given back to through /proc, we would be known as "exe". */
+    if(handoff_fd >= 0) {
+        const char *p = strrchr(argv0, '/');
+        prctl(PR_SET_NAME, p ? p + 1 : argv0, 0, 0, 0);
+    }
+#endif
+
+    len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if(len > 0) {
+        buf[len] = '\0';
+        /* After a failed upgrade, we run the old binary, which has been
+           replaced; the next upgrade should use the replacement. */
+        if(len > 10 && strcmp(buf + len - 10, " (deleted)") == 0)
+            buf[len - 10] = '\0';
+        handoff_binary = strdup(buf);
+    } else if(strchr(argv0, '/') != NULL) {
+        handoff_binary = realpath(argv0, NULL);
+    }
+}
+
+/* Exec a new instance and hand everything over to it.  Returns 1 if the
+   new instance took over, in which case we must exit without touching
+   anything, 0 if it failed and we carry on in a new process, and -1 if
+   we should carry on as before. */
+int
+handoff_start(char **argv)
+{
+    struct interface *ifp;
+    int sv[2], fds[HANDOFF_MAX_FDS], nfds = 0, nlocal = 0;
+    char header[HANDOFF_HEADER_LEN], buf[4];
+    pid_t pid, ppid;
+    FILE *out;
+    int rc, i, retried = 0;
+
+    /* Whatever is buffered is sent now, so that the new instance starts
+       with empty buffers. */
+    FOR_ALL_INTERFACES(ifp) {
+        if(!if_up(ifp))
+            continue;
+        flushupdates(ifp);
+        flushbuf(ifp);
+    }
+    flush_unicast(1);
+
+    /* Interval timers survive exec, and SIGPROF would kill the new
+       instance. */
+    profile_stop();
+
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    if(rc < 0) {
+        perror("socketpair(handoff)");
+        return -1;
+    }
+
+    /* Don't let the child flush our buffered output a second time. */
+    fflush(stdout);
+    fflush(stderr);
+
+    ppid = getpid();
+    pid = fork();
+    if(pid < 0) {
+        perror("fork(handoff)");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if(pid > 0) {
+        char fdbuf[20], exebuf[40];
+        close(sv[0]);
+        close_on_exec_all(sv[1]);
+        snprintf(fdbuf, 20, "%d", sv[1]);
+        setenv(HANDOFF_ENV, fdbuf, 1);
+        /* The child's image is ours, even if the binary has since been
+           replaced on disk. */
+        snprintf(exebuf, 40, "/proc/%d/exe", (int)pid);
+        setenv(HANDOFF_FALLBACK_ENV, exebuf, 1);
+        if(handoff_binary)
+            execv(handoff_binary, argv);
+        else
+            execvp(argv[0], argv);
+        perror("exec(handoff)");
+        unsetenv(HANDOFF_ENV);
+        unsetenv(HANDOFF_FALLBACK_ENV);
+        /* Kill the child before it notices, or it would carry on too. */
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sv[1]);
+        return -1;
+    }
+
+    close(sv[1]);
+    rc = set_handoff_timeout(sv[0]);
+    if(rc < 0) {
+        perror("setsockopt(handoff)");
+        goto fail;
+    }
+
+    fds[nfds++] = protocol_socket;
+    if(kernel_socket >= 0)
+        fds[nfds++] = kernel_socket;
+#ifndef NO_LOCAL_INTERFACE
+    if(local_server_socket >= 0)
+        fds[nfds++] = local_server_socket;
+    for(i = 0; i < num_local_sockets; i++)
+        fds[nfds++] = local_sockets[i];
+    nlocal = num_local_sockets;
+#endif
+
+ again:
+    memset(header, 0, HANDOFF_HEADER_LEN);
+    snprintf(header, HANDOFF_HEADER_LEN, "babeld-handoff %d %d %d %d %d",
+             HANDOFF_VERSION, protocol_port, kernel_socket >= 0,
+#ifndef NO_LOCAL_INTERFACE
+             local_server_socket >= 0,
+#else
+             0,
+#endif
+             nlocal);
+    rc = send_fds(sv[0], header, HANDOFF_HEADER_LEN, fds, nfds);
+    if(rc < 0) {
+        perror("sendmsg(handoff)");
+        goto fail;
+    }
+
+    rc = dup(sv[0]);
+    if(rc < 0) {
+        perror("dup(handoff)");
+        goto fail;
+    }
+    out = fdopen(rc, "w");
+    if(out == NULL) {
+        perror("fdopen(handoff)");
+        close(rc);
+        goto fail;
+    }
+    dump_state(out);
+    fflush(out);
+    rc = ferror(out);
+    fclose(out);
+    if(rc) {
+        fprintf(stderr, "Couldn't write state to new instance.\n");
+        goto fail;
+    }
+
+    rc = read(sv[0], buf, 3);
+    if(rc == 3 && memcmp(buf, "no\n", 3) == 0 && !retried) {
+        /* The new instance couldn't take over, and is execing our own
+           binary so as to keep its pid; hand over to that instead. */
+        fprintf(stderr, "New instance failed, handing over to old binary.\n");
+        retried = 1;
+        goto again;
+    }
+    if(rc < 3 || memcmp(buf, "ok\n", 3) != 0) {
+        fprintf(stderr, "New instance didn't acknowledge handoff.\n");
+        goto fail;
+    }
+
+    close(sv[0]);
+    return 1;
+
+ fail:
+    close(sv[0]);
+    /* The new instance died or hung, since otherwise it would have handed
+       back to us.  Not SIGTERM, which would make it tear down our routes.
+       If it has already exited, we have been reparented, and ppid is not
+       ours to kill. */
+    if(getppid() == ppid)
+        kill(ppid, SIGKILL);
+    return 0;
+}
+
+/* Called early by the new instance; returns 1 if we are taking over from
+   a running instance. */
+int
+handoff_check(void)
+{
+    char *s;
+    int rc;
+
+    s = getenv(HANDOFF_ENV);
+    if(s == NULL)
+        return 0;
+
+    handoff_fd = atoi(s);
+    unsetenv(HANDOFF_ENV);
+    s = getenv(HANDOFF_FALLBACK_ENV);
+    if(s != NULL) {
+        handoff_fallback = strdup(s);
+        unsetenv(HANDOFF_FALLBACK_ENV);
+    }
+    if(handoff_fd < 3)
+        goto fail;
+
+    rc = fcntl(handoff_fd, F_GETFD, 0);
+    if(rc < 0)
+        goto fail;
+    fcntl(handoff_fd, F_SETFD, rc | FD_CLOEXEC);
+
+    rc = set_handoff_timeout(handoff_fd);
+    if(rc < 0)
+        goto fail;
+
+    return 1;
+
+ fail:
+    fprintf(stderr, "Bad handoff socket.\n");
+    handoff_fd = -1;
+    return -1;
+}
+
+int
+handoff_receive_sockets(void)
+{
+    char header[HANDOFF_HEADER_LEN + 1];
+    int fds[HANDOFF_MAX_FDS];
+    int rc, n, i = 0, version, port, haskernel, hasserver, nlocal;
+
+    n = receive_fds(handoff_fd, header, HANDOFF_HEADER_LEN,
+                    fds, HANDOFF_MAX_FDS);
+    if(n < 0) {
+        fprintf(stderr, "Couldn't receive sockets from old instance.\n");
+        return -1;
+    }
+    header[HANDOFF_HEADER_LEN] = '\0';
+
+    rc = sscanf(header, "babeld-handoff %d %d %d %d %d",
+                &version, &port, &haskernel, &hasserver, &nlocal);
+    if(rc != 5 || version != HANDOFF_VERSION || port != protocol_port ||
+       n != 1 + haskernel + hasserver + nlocal) {
+        fprintf(stderr, "Incompatible handoff from old instance.\n");
+        goto fail;
+    }
+
+    protocol_socket = fds[i++];
+    if(haskernel) {
+        rc = kernel_adopt_socket(fds[i++]);
+    } else {
+        rc = kernel_setup_socket(1);
+    }
+    if(rc < 0) {
+        fprintf(stderr, "kernel_setup_socket failed.\n");
+        goto fail;
+    }
+
+#ifndef NO_LOCAL_INTERFACE
+    if(hasserver)
+        local_server_socket = fds[i++];
+    /* Clients are only told about us once we have our state. */
+    while(i < n) {
+        if(num_adopted_sockets < MAX_LOCAL_SOCKETS)
+            adopted_sockets[num_adopted_sockets++] = fds[i++];
+        else
+            close(fds[i++]);
+    }
+#else
+    while(i < n)
+        close(fds[i++]);
+#endif
+
+    handoff_in = fdopen(handoff_fd, "r");
+    if(handoff_in == NULL) {
+        perror("fdopen(handoff)");
+        return -1;
+    }
+
+    return 1;
+
+ fail:
+    while(i < n)
+        close(fds[i++]);
+    return -1;
+}
+
+/* Read one record, splitting it into at most maxtokens tokens.  Returns
+   the number of tokens, or -1 on end of stream. */
+static int
+read_record(char *buf, int len, char **tokens, int maxtokens)
+{
+    char *p;
+    int n = 0;
+
+    if(fgets(buf, len, handoff_in) == NULL)
+        return -1;
+
+    p = strtok(buf, " \n");
+    while(p && n < maxtokens) {
+        tokens[n++] = p;
+        p = strtok(NULL, " \n");
+    }
+    return n;
+}
+
+static struct interface *
+find_interface(const char *name)
+{
+    struct interface *ifp;
+    FOR_ALL_INTERFACES(ifp) {
+        if(strcmp(ifp->name, name) == 0)
+            return ifp;
+    }
+    return NULL;
+}
+
+/* Router-id, seqnos, anything that must be known before the interfaces
+   come up. */
+int
+handoff_receive_globals(void)
+{
+    char buf[200], *t[6];
+    int n;
+
+    while(1) {
+        n = read_record(buf, 200, t, 6);
+        if(n < 0) {
+            fprintf(stderr, "Truncated handoff from old instance.\n");
+            return -1;
+        }
+        if(n < 1)
+            continue;
+        if(strcmp(t[0], "resume") == 0) {
+            break;
+        } else if(strcmp(t[0], "id") == 0 && n >= 2) {
+            if(parse_eui64(t[1], myid) >= 0)
+                have_id = 1;
+        } else if(strcmp(t[0], "seqno") == 0 && n >= 2) {
+            myseqno = atoi(t[1]) & 0xFFFF;
+        } else if(strcmp(t[0], "interface") == 0 && n >= 3) {
+            struct interface *ifp = find_interface(t[1]);
+            if(ifp) {
+                ifp->hello_seqno = atoi(t[2]) & 0xFFFF;
+                if(n >= 4)
+                    ifp->unicast_hello_seqno = atoi(t[3]) & 0xFFFF;
+                if(n >= 6) {
+                    parse_age(&ifp->hello_timeout, t[4]);
+                    parse_age(&ifp->update_timeout, t[5]);
+                }
+            }
+        } else {
+            debugf("Unknown handoff record %s.\n", t[0]);
+        }
+    }
+    return 1;
+}
+
+static int
+restore_one_neighbour(char **t, int n)
+{
+    struct neighbour neigh;
+    int af, rc;
+
+    if(n < 15)
+        return -1;
+    memset(&neigh, 0, sizeof(neigh));
+    neigh.ifp = find_interface(t[1]);
+    if(neigh.ifp == NULL || !if_up(neigh.ifp))
+        return -1;
+    rc = parse_address(t[2], neigh.address, &af);
+    if(rc < 0)
+        return -1;
+
+    neigh.hello.seqno = atoi(t[3]);
+    neigh.hello.reach = strtoul(t[4], NULL, 16);
+    neigh.txcost = atoi(t[5]);
+    parse_age(&neigh.hello.time, t[6]);
+    parse_age(&neigh.ihu_time, t[7]);
+    neigh.hello.interval = atoi(t[8]);
+    neigh.ihu_interval = atoi(t[9]);
+    neigh.hello_send_us = strtoul(t[10], NULL, 10);
+    parse_age(&neigh.hello_rtt_receive_time, t[11]);
+    neigh.rtt = strtoul(t[12], NULL, 10);
+    parse_age(&neigh.rtt_time, t[13]);
+    /* Older versions didn't carry the router-id, which is learnt
+       again from the next Hello. */
+    neigh.digest = atoi(t[14]);
+    if(n < 16 || parse_eui64(t[15], neigh.digest_id) < 0)
+        neigh.digest = 0;
+    /* Nor the history of Unicast Hellos. */
+    neigh.uhello.seqno = -1;
+    if(n >= 20) {
+        neigh.uhello.seqno = atoi(t[16]);
+        neigh.uhello.reach = strtoul(t[17], NULL, 16);
+        parse_age(&neigh.uhello.time, t[18]);
+        neigh.uhello.interval = atoi(t[19]);
+    }
+
+    return restore_neighbour(&neigh) ? 1 : -1;
+}
+
+static int
+restore_source(char **t, int n)
+{
+    struct source *src;
+    unsigned char id[8], prefix[16], src_prefix[16], plen, src_plen;
+    int af, rc;
+
+    if(n < 7)
+        return -1;
+    rc = parse_eui64(t[1], id);
+    if(rc >= 0)
+        rc = parse_net(t[2], prefix, &plen, &af);
+    if(rc >= 0)
+        rc = parse_net(t[3], src_prefix, &src_plen, &af);
+    if(rc < 0)
+        return -1;
+    src = find_source(id, prefix, plen, src_prefix, src_plen,
+                      1, atoi(t[4]));
+    if(src == NULL)
+        return -1;
+    src->seqno = atoi(t[4]);
+    src->metric = atoi(t[5]);
+    src->time = now.tv_sec - atol(t[6]);
+    return 1;
+}
+
+static int
+restore_one_route(char **t, int n)
+{
+    struct babel_route route;
+    struct interface *ifp;
+    unsigned char id[8], prefix[16], src_prefix[16], address[16];
+    unsigned char plen, src_plen;
+    unsigned int channel;
+    int af, rc, i;
+
+    if(n < 17)
+        return -1;
+
+    memset(&route, 0, sizeof(route));
+    ifp = find_interface(t[4]);
+    if(ifp == NULL)
+        return -1;
+    rc = parse_net(t[1], prefix, &plen, &af);
+    if(rc >= 0)
+        rc = parse_net(t[2], src_prefix, &src_plen, &af);
+    if(rc >= 0)
+        rc = parse_eui64(t[3], id);
+    if(rc >= 0)
+        rc = parse_address(t[5], address, &af);
+    if(rc >= 0)
+        rc = parse_address(t[6], route.nexthop, &af);
+    if(rc < 0)
+        return -1;
+
+    FOR_ALL_NEIGHBOURS(route.neigh) {
+        if(route.neigh->ifp == ifp &&
+           memcmp(route.neigh->address, address, 16) == 0)
+            break;
+    }
+    route.src = find_source(id, prefix, plen, src_prefix, src_plen, 0, 0);
+    if(route.neigh == NULL || route.src == NULL)
+        return -1;
+
+    route.refmetric = atoi(t[7]);
+    route.cost = atoi(t[8]);
+    route.add_metric = atoi(t[9]);
+    route.seqno = atoi(t[10]);
+    route.hold_time = atoi(t[11]);
+    route.time = now.tv_sec - atol(t[12]);
+    route.smoothed_metric = atoi(t[13]);
+    route.smoothed_metric_time = now.tv_sec - atol(t[14]);
+    route.installed = atoi(t[15]);
+    for(i = 0; i < DIVERSITY_HOPS; i++) {
+        if(sscanf(t[16] + 2 * i, "%2x", &channel) != 1)
+            break;
+        route.channels[i] = channel;
+    }
+
+    return restore_route(&route) ? 1 : -1;
+}
+
+static int
+restore_one_rule(char **t, int n)
+{
+    unsigned char src[16], plen;
+    int af, rc;
+
+    if(n < 4)
+        return -1;
+    rc = parse_net(t[2], src, &plen, &af);
+    if(rc < 0)
+        return -1;
+    return restore_rule(atoi(t[1]), src, plen, atoi(t[3]));
+}
+
+static int
+restore_resend(char **t, int n)
+{
+    struct interface *ifp = NULL;
+    unsigned char prefix[16], src_prefix[16], id[8];
+    unsigned char plen, src_plen;
+    int af, rc, have_id = 0;
+
+    if(n < 8)
+        return -1;
+    rc = parse_net(t[2], prefix, &plen, &af);
+    if(rc >= 0)
+        rc = parse_net(t[3], src_prefix, &src_plen, &af);
+    if(rc >= 0 && strcmp(t[5], "-") != 0) {
+        rc = parse_eui64(t[5], id);
+        have_id = 1;
+    }
+    if(rc < 0)
+        return -1;
+    if(strcmp(t[6], "-") != 0) {
+        ifp = find_interface(t[6]);
+        if(ifp == NULL || !if_up(ifp))
+            return -1;
+    }
+    return record_resend(atoi(t[1]), prefix, plen, src_prefix, src_plen,
+                         atoi(t[4]), have_id ? id : NULL, ifp, atoi(t[7]));
+}
+
+/* Everything else, once the interfaces are up.  Acknowledges the handoff,
+   after which the old instance exits. */
+int
+handoff_receive_state(void)
+{
+    char buf[500], *t[20], *kind;
+    int n, rc;
+
+    while(1) {
+        n = read_record(buf, 500, t, 20);
+        if(n < 0) {
+            fprintf(stderr, "Truncated handoff from old instance.\n");
+            return -1;
+        }
+        if(n < 1)
+            continue;
+        kind = t[0];
+        if(strcmp(kind, "end") == 0) {
+            handoff_in_done = 1;
+            break;
+        }
+        else if(strcmp(kind, "setting") == 0)
+            rc = n >= 3 ? kernel_restore_setting(t[1], atoi(t[2])) : -1;
+        else if(strcmp(kind, "neighbour") == 0)
+            rc = restore_one_neighbour(t, n);
+        else if(strcmp(kind, "source") == 0)
+            rc = restore_source(t, n);
+        else if(strcmp(kind, "route") == 0)
+            rc = restore_one_route(t, n);
+        else if(strcmp(kind, "rule") == 0)
+            rc = restore_one_rule(t, n);
+        else if(strcmp(kind, "resend") == 0)
+            rc = restore_resend(t, n);
+        else
+            rc = 0;
+        if(rc < 0)
+            fprintf(stderr, "Couldn't restore %s from old instance.\n", kind);
+    }
+
+    rc = write(handoff_fd, "ok\n", 3);
+    if(rc < 3) {
+        perror("write(handoff)");
+        return -1;
+    }
+    fclose(handoff_in);
+    handoff_in = NULL;
+    handoff_fd = -1;
+
+#ifndef NO_LOCAL_INTERFACE
+    while(num_adopted_sockets > 0) {
+        int s = adopted_sockets[--num_adopted_sockets];
+        local_sockets[num_local_sockets++] = s;
+        local_notify_all_1(s);
+    }
+#endif
+
+    return 1;
+}
+
+/* Called by the new instance when it cannot take over, before it has
+   touched anything.  Our pid is the one a supervisor tracks, so rather
+   than exiting, we exec the binary of the old instance, which is still
+   running as our child and hands over to it instead.  Only returns on
+   failure. */
+void
+handoff_give_back(char **argv)
+{
+    char buf[500], *t[1], fdbuf[20];
+    int n, rc;
+
+    if(handoff_fd < 0 || handoff_fallback == NULL)
+        return;
+
+    /* Skip whatever is left of the state, the old instance only listens
+       once it has sent it all. */
+    if(handoff_in == NULL) {
+        handoff_in = fdopen(handoff_fd, "r");
+        if(handoff_in == NULL) {
+            perror("fdopen(handoff)");
+            return;
+        }
+    }
+    while(!handoff_in_done) {
+        n = read_record(buf, 500, t, 1);
+        if(n < 0) {
+            fprintf(stderr, "Truncated handoff from old instance.\n");
+            return;
+        }
+        if(n >= 1 && strcmp(t[0], "end") == 0)
+            handoff_in_done = 1;
+    }
+
+    rc = write(handoff_fd, "no\n", 3);
+    if(rc < 3) {
+        perror("write(handoff)");
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    close_on_exec_all(handoff_fd);
+    rc = fcntl(handoff_fd, F_GETFD, 0);
+    if(rc >= 0)
+        fcntl(handoff_fd, F_SETFD, rc & ~FD_CLOEXEC);
+    snprintf(fdbuf, 20, "%d", handoff_fd);
+    setenv(HANDOFF_ENV, fdbuf, 1);
+    execv(handoff_fallback, argv);
+    perror("exec(handoff fallback)");
+}
@@ -41,9 +41,13 @@ THE SOFTWARE.
 #include "route.h"
 #include "configuration.h"
 #include "xroute.h"
+#include "handoff.h"
 
 struct interface *interfaces = NULL;
 
+static const unsigned char v4prefix[16] =
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0 };
+
 static struct interface *
 last_interface(void)
 {
@@ -80,6 +84,7 @@ add_interface(char *ifname, struct interface_conf *if_conf)
     ifp->bucket_time = now.tv_sec;
     ifp->bucket = BUCKET_TOKENS_MAX;
     ifp->hello_seqno = (random() & 0xFFFF);
+    ifp->unicast_hello_seqno = (random() & 0xFFFF);
 
     if(interfaces == NULL)
         interfaces = ifp;
@@ -133,7 +138,8 @@ check_interface_ipv4(struct interface *ifp)
     if(rc > 0) {
         if(!ifp->ipv4 || memcmp(ipv4, ifp->ipv4, 4) != 0) {
             debugf("Noticed IPv4 change for %s.\n", ifp->name);
-            flush_interface_routes(ifp, 0);
+            flush_interface_routes(ifp, 1);
+            ifp->digest_generation = 0;
             if(!ifp->ipv4)
                 ifp->ipv4 = malloc(4);
             if(ifp->ipv4)
@@ -143,7 +149,8 @@ check_interface_ipv4(struct interface *ifp)
     } else {
         if(ifp->ipv4) {
             debugf("Noticed IPv4 change for %s.\n", ifp->name);
-            flush_interface_routes(ifp, 0);
+            flush_interface_routes(ifp, 1);
+            ifp->digest_generation = 0;
             free(ifp->ipv4);
             ifp->ipv4 = NULL;
             return 1;
@@ -363,6 +370,15 @@ interface_up(struct interface *ifp, int up)
             ifp->max_rtt_penalty > 0))
             ifp->flags |= IF_TIMESTAMPS;
 
+        if(IF_CONF(ifp, enable_digests) == CONFIG_YES)
+            ifp->flags |= IF_DIGEST;
+        ifp->digest_pending = 0;
+
+        if(IF_CONF(ifp, unicast) == CONFIG_YES)
+            ifp->flags |= IF_UNICAST;
+        else
+            ifp->flags &= ~IF_UNICAST;
+
         rc = check_link_local_addresses(ifp);
         if(rc < 0) {
             goto fail;
@@ -372,7 +388,8 @@ interface_up(struct interface *ifp, int up)
         mreq.ipv6mr_interface = ifp->ifindex;
         rc = setsockopt(protocol_socket, IPPROTO_IPV6, IPV6_JOIN_GROUP,
                         (char*)&mreq, sizeof(mreq));
-        if(rc < 0) {
+        /* After an upgrade, the socket is already in the group. */
+        if(rc < 0 && errno != EADDRINUSE) {
             perror("setsockopt(IPV6_JOIN_GROUP)");
             goto fail;
         }
@@ -388,12 +405,22 @@ interface_up(struct interface *ifp, int up)
                ifp->channel,
                ifp->ipv4 ? ", IPv4" : "");
 
-        set_timeout(&ifp->hello_timeout, ifp->hello_interval);
-        set_timeout(&ifp->update_timeout, ifp->update_interval);
-        send_hello(ifp);
-        if(rc > 0)
-            send_update(ifp, 0, NULL, 0, NULL, 0);
-        send_request(ifp, NULL, 0, NULL, 0);
+        ifp->hello_template_len = 0;
+        summary_changed(NULL, 0);
+        ifp->digest_generation = 0;
+        /* During an upgrade, our neighbours never noticed we were gone:
+           keep to the schedule of the old instance, and don't make them
+           resend their tables. */
+        if(handoff_fd < 0 || ifp->hello_timeout.tv_sec == 0)
+            set_timeout(&ifp->hello_timeout, ifp->hello_interval);
+        if(handoff_fd < 0 || ifp->update_timeout.tv_sec == 0)
+            set_timeout(&ifp->update_timeout, ifp->update_interval);
+        if(handoff_fd < 0) {
+            send_hello(ifp);
+            if(rc > 0)
+                send_update(ifp, 0, NULL, 0, NULL, 0);
+            send_request(ifp, NULL, 0, NULL, 0);
+        }
     } else {
         flush_interface_routes(ifp, 0);
         ifp->buffered = 0;
@@ -405,6 +432,12 @@ interface_up(struct interface *ifp, int up)
             free(ifp->buffered_updates);
         ifp->buffered_updates = NULL;
         ifp->sendbuf = NULL;
+        free(ifp->hello_template);
+        ifp->hello_template = NULL;
+        free(ifp->digest_leaves);
+        ifp->digest_leaves = NULL;
+        ifp->hello_template_len = 0;
+        ifp->hello_template_size = 0;
         if(ifp->ifindex > 0) {
             memset(&mreq, 0, sizeof(mreq));
             memcpy(&mreq.ipv6mr_multiaddr, protocol_group, 16);
@@ -444,14 +477,26 @@ interface_ll_address(struct interface *ifp, const unsigned char *address)
     return 0;
 }
 
-void
-check_interfaces(void)
+/* If budget is positive, check at most budget interfaces, and resume
+   from there on the next call.  Returns 1 if there is work left.  Since
+   interfaces are never freed, remembering our position is safe. */
+int
+check_interfaces(int budget)
 {
+    static struct interface *next_ifp = NULL;
+    static int ifindex_changed = 0;
     struct interface *ifp;
-    int rc, ifindex_changed = 0;
+    int rc, n = 0;
     unsigned int ifindex;
 
-    FOR_ALL_INTERFACES(ifp) {
+    ifp = budget > 0 && next_ifp ? next_ifp : interfaces;
+    for(; ifp; ifp = ifp->next) {
+        if(budget > 0 && n >= budget) {
+            next_ifp = ifp;
+            return 1;
+        }
+        n++;
+
         ifindex = if_nametoindex(ifp->name);
         if(ifindex != ifp->ifindex) {
             debugf("Noticed ifindex change for %s.\n", ifp->name);
@@ -477,12 +522,16 @@ check_interfaces(void)
             check_interface_channel(ifp);
             rc = check_interface_ipv4(ifp);
             if(rc > 0) {
-                send_request(ifp, NULL, 0, NULL, 0);
+                /* Only the IPv4 routes were flushed, ask for those. */
+                send_request_range(ifp, v4prefix, 96);
                 send_update(ifp, 0, NULL, 0, NULL, 0);
             }
         }
     }
 
+    next_ifp = NULL;
     if(ifindex_changed)
         renumber_filters();
+    ifindex_changed = 0;
+    return 0;
 }
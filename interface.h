@@ -38,8 +38,11 @@ struct interface_conf {
     char split_horizon;
     char lq;
     char faraway;
+    char v4viav6;
     int channel;
     int enable_timestamps;
+    int enable_digests;
+    char unicast;
     unsigned int rtt_decay;
     unsigned int rtt_min;
     unsigned int rtt_max;
@@ -57,6 +60,8 @@ struct interface_conf {
 #define IF_LQ (1 << 3)
 #define IF_FARAWAY (1 << 4)
 #define IF_TIMESTAMPS (1 << 5)
+#define IF_DIGEST (1 << 6)
+#define IF_UNICAST (1 << 7)
 
 /* Only INTERFERING can appear on the wire. */
 #define IF_CHANNEL_UNKNOWN 0
@@ -90,6 +95,12 @@ struct interface {
     unsigned char buffered_nh[4];
     unsigned char buffered_prefix[16];
     unsigned char *sendbuf;
+    /* The Hello and IHUs sent every Hello interval, see send_hello.
+       A length of 0 means that it must be rebuilt. */
+    unsigned char *hello_template;
+    int hello_template_len;
+    int hello_template_hello;
+    int hello_template_size;
     struct buffered_update *buffered_updates;
     int num_buffered_updates;
     int update_bufsize;
@@ -97,7 +108,30 @@ struct interface {
     unsigned int bucket;
     time_t last_update_time;
     time_t last_specific_update_time;
+    /* The next Hello carries a digest instead of a full update. */
+    int digest_pending;
+    /* The leaves of what we announce here, see interface_leaves. */
+    unsigned int *digest_leaves;
+    unsigned int digest_generation;
+    /* Bytes sent, used to estimate airtime. */
+    unsigned long long multicast_bytes;
+    unsigned long long unicast_bytes;
+    /* Adaptive aggregation, see schedule_flush. */
+    struct timeval buffered_time;
+    unsigned int send_rate;     /* bytes per second, smoothed */
+    unsigned int rate_bytes;
+    struct timeval rate_time;
+    /* A retraction or urgent update is pending, which timer slack must
+       not delay. */
+    char flush_urgent;
+    /* Packets flushed from sendbuf, their total fill in thousandths and
+       the total time their first message waited, in milliseconds. */
+    unsigned long long flushed_packets;
+    unsigned long long fill_total;
+    unsigned long long delay_total;
     unsigned short hello_seqno;
+    /* Unicast Hellos, sent on unicast interfaces, have their own seqno. */
+    unsigned short unicast_hello_seqno;
     unsigned hello_interval;
     unsigned update_interval;
     /* A higher value means we forget old RTT samples faster. Must be
@@ -128,4 +162,4 @@ unsigned update_jitter(struct interface *ifp, int urgent);
 void set_timeout(struct timeval *timeout, int msecs);
 int interface_up(struct interface *ifp, int up);
 int interface_ll_address(struct interface *ifp, const unsigned char *address);
-void check_interfaces(void);
+int check_interfaces(int budget);
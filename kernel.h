@@ -83,6 +83,9 @@ int add_import_table(int table);
 
 int kernel_setup(int setup);
 int kernel_setup_socket(int setup);
+int kernel_adopt_socket(int fd);
+int kernel_saved_setting(int i, const char **name_r, int *value_r);
+int kernel_restore_setting(const char *name, int value);
 int kernel_setup_interface(int setup, const char *ifname, int ifindex);
 int kernel_interface_operational(const char *ifname, int ifindex);
 int kernel_interface_ipv4(const char *ifname, int ifindex,
@@ -97,13 +100,19 @@ int kernel_route(int operation, int table,
                  const unsigned char *gate, int ifindex, unsigned int metric,
                  const unsigned char *newgate, int newifindex,
                  unsigned int newmetric, int newtable);
+int kernel_resolve_neighbour(const unsigned char *address, int ifindex);
 int kernel_dump(int operation, struct kernel_filter *filter);
 int kernel_callback(struct kernel_filter *filter);
+int kernel_sample_filter(void);
+int kernel_notification_stats(unsigned int *received_r,
+                              unsigned int *ignored_r,
+                              unsigned int *rejected_r);
 int if_eui64(char *ifname, int ifindex, unsigned char *eui);
 int gettime(struct timeval *tv);
 int read_random_bytes(void *buf, int len);
 int kernel_older_than(const char *sysname, int version, int sub_version);
 int kernel_has_ipv6_subtrees(void);
+int kernel_has_v4viav6(void);
 int add_rule(int prio, const unsigned char *src_prefix, int src_plen,
              int table);
 int flush_rule(int prio, int family);
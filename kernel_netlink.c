@@ -21,6 +21,7 @@ THE SOFTWARE.
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -41,12 +42,21 @@ THE SOFTWARE.
 #include <linux/rtnetlink.h>
 #include <linux/if_bridge.h>
 #include <linux/fib_rules.h>
+#include <linux/filter.h>
 #include <net/if_arp.h>
 
 #if(__GLIBC__ < 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ <= 5)
 #define RTA_TABLE 15
 #endif
 
+#ifndef SOL_NETLINK
+#define SOL_NETLINK 270
+#endif
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
 #include "babeld.h"
 #include "kernel.h"
 #include "util.h"
@@ -103,6 +113,7 @@ static int dgram_socket = -1;
 #endif
 
 static int filter_netlink(struct nlmsghdr *nh, struct kernel_filter *filter);
+static int netlink_filter_rejects(struct nlmsghdr *nh);
 
 
 /* Determine an interface's hardware address, in modified EUI-64 format */
@@ -226,8 +237,26 @@ struct netlink {
 
 static struct netlink nl_command = { 0, -1, {0}, 0 };
 static struct netlink nl_listen = { 0, -1, {0}, 0 };
+
+/* Statistics about the notifications received on nl_listen.  A socket
+   filter doesn't count the messages it drops, so the filter is lifted
+   for a second every minute, and the number of notifications it
+   rejects is extrapolated from what is received meanwhile. */
+static unsigned int notifications_received = 0, notifications_ignored = 0;
+static unsigned int notifications_rejected = 0, notifications_sampled = 0;
+static int notifications_filtered = 0, notifications_sampling = 0;
+static struct timeval filter_time, sample_time;
+
 static int nl_setup = 0;
 
+/* Whether nl_command has strict checking of dump requests, which lets
+   the kernel filter route dumps by table (Linux 4.20 and later). */
+static int nl_strict = 0;
+
+/* Receive buffer shared by all netlink sockets, grown on demand. */
+static char *nl_buf = NULL;
+static int nl_bufsize = 0;
+
 static int
 netlink_socket(struct netlink *nl, uint32_t groups)
 {
@@ -287,6 +316,54 @@ netlink_socket(struct netlink *nl, uint32_t groups)
     }
 }
 
+static void
+netlink_strict(struct netlink *nl)
+{
+    int rc, one = 1;
+
+    rc = setsockopt(nl->sock, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+                    &one, sizeof(one));
+    nl_strict = rc >= 0;
+    if(!nl_strict)
+        kdebugf("Netlink strict checking not available, "
+                "dumping whole tables.\n");
+}
+
+static int
+netlink_buffer(int size)
+{
+    char *new_buf;
+
+    if(size <= nl_bufsize)
+        return 0;
+
+    size = MAX(size, 32 * 1024);
+    new_buf = realloc(nl_buf, size);
+    if(new_buf == NULL)
+        return -1;
+    nl_buf = new_buf;
+    nl_bufsize = size;
+    return 0;
+}
+
+static int
+netlink_recvmsg(struct netlink *nl, struct msghdr *msg, int flags)
+{
+    int rc, len;
+
+    len = recvmsg(nl->sock, msg, flags);
+    if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        rc = wait_for_fd(0, nl->sock, 100);
+        if(rc <= 0) {
+            if(rc == 0)
+                errno = EAGAIN;
+            return -1;
+        }
+        len = recvmsg(nl->sock, msg, flags);
+    }
+    return len;
+}
+
 static int
 netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
              struct kernel_filter *filter)
@@ -310,7 +387,10 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
     int done = 0;
     int skip = 0;
 
-    char buf[8192];
+    if(netlink_buffer(1) < 0) {
+        perror("netlink_read: malloc");
+        return -1;
+    }
 
     memset(&nladdr, 0, sizeof(nladdr));
     nladdr.nl_family = AF_NETLINK;
@@ -321,21 +401,20 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
     msg.msg_iov = &iov;
     msg.msg_iovlen = 1;
 
-    iov.iov_base = &buf;
-
     do {
-        iov.iov_len = sizeof(buf);
-        len = recvmsg(nl->sock, &msg, 0);
-
-        if(len < 0 && (errno == EAGAIN || errno == EINTR)) {
-            int rc;
-            rc = wait_for_fd(0, nl->sock, 100);
-            if(rc <= 0) {
-                if(rc == 0)
-                    errno = EAGAIN;
-            } else {
-                len = recvmsg(nl->sock, &msg, 0);
-            }
+        /* Peek at the size of the next datagram, so that a large dump
+           chunk is never truncated. */
+        iov.iov_base = nl_buf;
+        iov.iov_len = nl_bufsize;
+        len = netlink_recvmsg(nl, &msg, MSG_PEEK | MSG_TRUNC);
+        if(len > nl_bufsize && netlink_buffer(len) < 0) {
+            perror("netlink_read: malloc");
+            return -1;
+        }
+        if(len > 0) {
+            iov.iov_base = nl_buf;
+            iov.iov_len = nl_bufsize;
+            len = netlink_recvmsg(nl, &msg, 0);
         }
 
         if(len < 0) {
@@ -356,15 +435,25 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
 
         kdebugf("Netlink message: ");
 
-        for(nh = (struct nlmsghdr *)buf;
+        for(nh = (struct nlmsghdr *)nl_buf;
             NLMSG_OK(nh, len);
             nh = NLMSG_NEXT(nh, len)) {
             kdebugf("%s{seq:%d}", (nh->nlmsg_flags & NLM_F_MULTI) ? "[multi] " : "",
                     nh->nlmsg_seq);
             if(!answer)
                 done = 1;
+            if(nl == &nl_listen && notifications_sampling &&
+               netlink_filter_rejects(nh)) {
+                kdebugf("(sampled), ");
+                notifications_sampled++;
+                continue;
+            }
+            if(nl == &nl_listen)
+                notifications_received++;
             if(nl_ignore && nh->nlmsg_pid == nl_ignore->sockaddr.nl_pid) {
                 kdebugf("(ignore), ");
+                if(nl == &nl_listen)
+                    notifications_ignored++;
                 continue;
             } else if(answer && (nh->nlmsg_pid != nl->sockaddr.nl_pid ||
                                  nh->nlmsg_seq != nl->seqno)) {
@@ -373,6 +462,18 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
                         nh->nlmsg_pid, nl->sockaddr.nl_pid);
                 continue;
             } else if(nh->nlmsg_type == NLMSG_DONE) {
+                /* Errors that occur during a dump are reported here
+                   rather than in an NLMSG_ERROR. */
+                if(nh->nlmsg_len >= NLMSG_LENGTH(sizeof(int))) {
+                    int error;
+                    memcpy(&error, NLMSG_DATA(nh), sizeof(int));
+                    if(error < 0) {
+                        kdebugf("(done) netlink_read: %s\n",
+                                strerror(-error));
+                        errno = -error;
+                        return -1;
+                    }
+                }
                 kdebugf("(done)\n");
                 done = 1;
                 break;
@@ -392,6 +493,8 @@ netlink_read(struct netlink *nl, struct netlink *nl_ignore, int answer,
                 kdebugf("(msg -> \"");
                 err = filter_netlink(nh, filter);
                 kdebugf("\" %d), ", err);
+                if(nl == &nl_listen && err == 0)
+                    notifications_ignored++;
                 if(err < 0) skip = 1;
                 continue;
             }
@@ -476,15 +579,14 @@ netlink_send_dump(int type, void *data, int len) {
     } buf;
     int rc;
 
-    /* At least we should send an 'struct rtgenmsg' */
+    /* At least we should send a family header */
     if(data == NULL || len == 0) {
         errno = EIO;
         return -1;
     }
 
-    /* And more : using anything else that 'struct rtgenmsg' is currently */
-    /* ignored by the linux kernel (today: 2.6.21) because NLM_F_MATCH is */
-    /* not yet implemented */
+    /* Anything beyond the family is ignored by the kernel unless      */
+    /* strict checking is enabled on the socket (see netlink_strict).  */
 
     memset(&nladdr, 0, sizeof(nladdr));
     nladdr.nl_family = AF_NETLINK;
@@ -543,6 +645,7 @@ kernel_setup(int setup)
             perror("netlink_socket(0)");
             return -1;
         }
+        netlink_strict(&nl_command);
         nl_setup = 1;
 
         if(skip_kernel_setup) return 1;
@@ -572,6 +675,10 @@ kernel_setup(int setup)
         nl_command.sock = -1;
         nl_setup = 0;
 
+        free(nl_buf);
+        nl_buf = NULL;
+        nl_bufsize = 0;
+
         if(skip_kernel_setup) return 1;
 
         for(i=0; i<NUM_SYSCTLS; i++) {
@@ -590,6 +697,166 @@ kernel_setup(int setup)
     }
 }
 
+/* Attach a socket filter to the listening socket that drops route
+   notifications that we would ignore anyway: those for tables that we
+   don't import, our own routes and cached routes.  Routes in tables
+   above 255 are reported with table RT_TABLE_COMPAT, and must be
+   checked in user space. */
+static int
+netlink_attach_filter(int sock)
+{
+    struct sock_filter code[16 + MAX_IMPORT_TABLES];
+    struct sock_fprog prog;
+    int i, j, n, accept, drop, compat = 0, rc;
+
+    for(i = 0; i < import_table_count; i++) {
+        if(import_tables[i] > 255 || import_tables[i] == RT_TABLE_COMPAT)
+            compat = 1;
+    }
+
+    /* The drop and accept statements come last. */
+    n = 10 + import_table_count + compat;
+    drop = n - 2;
+    accept = n - 1;
+
+#define JUMP(_from, _to) ((_to) - (_from) - 1)
+    i = 0;
+    /* nlmsg_type */
+    code[i] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+                                           offsetof(struct nlmsghdr,
+                                                    nlmsg_type));
+    i++;
+    code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           htons(RTM_NEWROUTE), 1, 0);
+    i++;
+    code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           htons(RTM_DELROUTE),
+                                           0, JUMP(i, accept));
+    i++;
+    code[i] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                                           NLMSG_HDRLEN +
+                                           offsetof(struct rtmsg,
+                                                    rtm_protocol));
+    i++;
+    code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                           RTPROT_BABEL, JUMP(i, drop), 0);
+    i++;
+    code[i] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                           NLMSG_HDRLEN +
+                                           offsetof(struct rtmsg, rtm_flags));
+    i++;
+    code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,
+                                           htonl(RTM_F_CLONED),
+                                           JUMP(i, drop), 0);
+    i++;
+    code[i] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+                                           NLMSG_HDRLEN +
+                                           offsetof(struct rtmsg, rtm_table));
+    i++;
+    if(compat) {
+        code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                               RT_TABLE_COMPAT,
+                                               JUMP(i, accept), 0);
+        i++;
+    }
+    for(j = 0; j < import_table_count; j++) {
+        /* Tables above 255 never match, see RT_TABLE_COMPAT above. */
+        code[i] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                               import_tables[j],
+                                               JUMP(i, accept), 0);
+        i++;
+    }
+    code[i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    i++;
+    code[i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+    i++;
+#undef JUMP
+
+    prog.len = i;
+    prog.filter = code;
+    rc = setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+    if(rc < 0) {
+        perror("setsockopt(SO_ATTACH_FILTER)");
+        notifications_filtered = 0;
+        return -1;
+    }
+    notifications_filtered = 1;
+    notifications_sampling = 0;
+    notifications_sampled = 0;
+    filter_time = now;
+    return 1;
+}
+
+/* Whether the filter attached by netlink_attach_filter drops nh. */
+static int
+netlink_filter_rejects(struct nlmsghdr *nh)
+{
+    struct rtmsg *rtm;
+    int i;
+
+    if(nh->nlmsg_type != RTM_NEWROUTE && nh->nlmsg_type != RTM_DELROUTE)
+        return 0;
+    if(nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg)))
+        return 0;
+    rtm = (struct rtmsg*)NLMSG_DATA(nh);
+    if(rtm->rtm_protocol == RTPROT_BABEL || (rtm->rtm_flags & RTM_F_CLONED))
+        return 1;
+    for(i = 0; i < import_table_count; i++) {
+        if(rtm->rtm_table == import_tables[i])
+            return 0;
+        if(rtm->rtm_table == RT_TABLE_COMPAT && import_tables[i] > 255)
+            return 0;
+    }
+    return 1;
+}
+
+/* Lift the filter on nl_listen, or put it back and extrapolate the
+   number of notifications it rejected since it was last attached.
+   Returns the number of seconds until the next call, or -1 if there is
+   no filter to sample. */
+int
+kernel_sample_filter(void)
+{
+    int one = 1, rc;
+    long long sampled, filtered;
+
+    if(notifications_sampling) {
+        sampled = timeval_minus_msec(&now, &sample_time);
+        filtered = timeval_minus_msec(&now, &filter_time);
+        if(sampled > 0)
+            notifications_rejected +=
+                notifications_sampled * filtered / sampled;
+        else
+            notifications_rejected += notifications_sampled;
+        rc = netlink_attach_filter(nl_listen.sock);
+        return rc < 0 ? -1 : 59;
+    }
+
+    if(!notifications_filtered || nl_listen.sock < 0)
+        return -1;
+
+    rc = setsockopt(nl_listen.sock, SOL_SOCKET, SO_DETACH_FILTER,
+                    &one, sizeof(one));
+    if(rc < 0) {
+        perror("setsockopt(SO_DETACH_FILTER)");
+        return -1;
+    }
+    notifications_sampling = 1;
+    notifications_sampled = 0;
+    sample_time = now;
+    return 1;
+}
+
+int
+kernel_notification_stats(unsigned int *received_r, unsigned int *ignored_r,
+                          unsigned int *rejected_r)
+{
+    *received_r = notifications_received;
+    *ignored_r = notifications_ignored;
+    *rejected_r = notifications_rejected;
+    return notifications_filtered;
+}
+
 static inline unsigned int
 rtnlgrp_to_mask(unsigned int grp)
 {
@@ -619,6 +886,7 @@ kernel_setup_socket(int setup)
         }
 
         kernel_socket = nl_listen.sock;
+        netlink_attach_filter(nl_listen.sock);
 
         return 1;
 
@@ -633,6 +901,30 @@ kernel_setup_socket(int setup)
     }
 }
 
+/* Used when taking over from a previous instance: the socket is already
+   bound and subscribed to the right groups. */
+int
+kernel_adopt_socket(int fd)
+{
+    int rc;
+
+    nl_listen.sock = fd;
+    nl_listen.socklen = sizeof(nl_listen.sockaddr);
+    rc = getsockname(fd, (struct sockaddr*)&nl_listen.sockaddr,
+                     &nl_listen.socklen);
+    if(rc < 0) {
+        perror("getsockname(netlink)");
+        close(fd);
+        nl_listen.sock = -1;
+        return kernel_setup_socket(1);
+    }
+    nl_listen.seqno = time(NULL);
+    kernel_socket = fd;
+    /* The import tables may have changed since the socket was set up. */
+    netlink_attach_filter(fd);
+    return 1;
+}
+
 static int
 get_old_if(const char *ifname)
 {
@@ -688,6 +980,50 @@ kernel_setup_interface(int setup, const char *ifname, int ifindex)
     return 1;
 }
 
+/* The settings that we changed and their original values, which are
+   passed to a new instance on upgrade so that it can restore them.
+   Returns 0 when i is past the end. */
+int
+kernel_saved_setting(int i, const char **name_r, int *value_r)
+{
+    static char buf[100];
+
+    if(i < NUM_SYSCTLS) {
+        *name_r = sysctl_settings[i].name;
+        *value_r = sysctl_settings[i].was;
+        return 1;
+    }
+    i -= NUM_SYSCTLS;
+    if(i < num_old_if) {
+        snprintf(buf, 100, "rp_filter:%s", old_if[i].ifname);
+        *name_r = buf;
+        *value_r = old_if[i].rp_filter;
+        return 1;
+    }
+    return 0;
+}
+
+int
+kernel_restore_setting(const char *name, int value)
+{
+    int i;
+
+    for(i = 0; i < NUM_SYSCTLS; i++) {
+        if(strcmp(sysctl_settings[i].name, name) == 0) {
+            sysctl_settings[i].was = value;
+            return 1;
+        }
+    }
+    if(strncmp(name, "rp_filter:", 10) == 0) {
+        i = get_old_if(name + 10);
+        if(i < 0)
+            return -1;
+        old_if[i].rp_filter = value;
+        return 1;
+    }
+    return -1;
+}
+
 int
 kernel_interface_operational(const char *ifname, int ifindex)
 {
@@ -916,6 +1252,13 @@ kernel_has_ipv6_subtrees(void)
     return (kernel_older_than("Linux", 3, 11) == 0);
 }
 
+/* IPv4 routes with an IPv6 next hop (RTA_VIA) appeared in Linux 5.2. */
+int
+kernel_has_v4viav6(void)
+{
+    return (kernel_older_than("Linux", 5, 2) == 0);
+}
+
 int
 kernel_route(int operation, int table,
              const unsigned char *dest, unsigned short plen,
@@ -928,7 +1271,7 @@ kernel_route(int operation, int table,
     struct rtmsg *rtm;
     struct rtattr *rta;
     int len = sizeof(buf.raw);
-    int rc, ipv4, use_src = 0;
+    int rc, ipv4, via, use_src = 0;
 
     if(!nl_setup) {
         fprintf(stderr,"kernel_route: netlink not initialized.\n");
@@ -948,10 +1291,10 @@ kernel_route(int operation, int table,
         }
     }
 
-    /* Check that the protocol family is consistent. */
+    /* Check that the protocol family is consistent.  IPv4 routes may
+       have an IPv6 next hop. */
     if(plen >= 96 && v4mapped(dest)) {
-        if(!v4mapped(gate) ||
-           (src_plen > 0 && (!v4mapped(src) || src_plen < 96))) {
+        if(src_plen > 0 && (!v4mapped(src) || src_plen < 96)) {
             errno = EINVAL;
             return -1;
         }
@@ -990,7 +1333,8 @@ kernel_route(int operation, int table,
     }
 
 
-    ipv4 = v4mapped(gate);
+    ipv4 = plen >= 96 && v4mapped(dest);
+    via = ipv4 && !v4mapped(gate);
     use_src = (src_plen != 0 && kernel_disambiguate(ipv4));
 
     kdebugf("kernel_route: %s %s from %s "
@@ -1059,7 +1403,16 @@ kernel_route(int operation, int table,
         rta->rta_type = RTA_OIF;
         *(int*)RTA_DATA(rta) = ifindex;
 
-        if(ipv4) {
+        if(via) {
+            struct rtvia *rtvia;
+            rta = RTA_NEXT(rta, len);
+            rta->rta_len = RTA_LENGTH(sizeof(struct rtvia) +
+                                      sizeof(struct in6_addr));
+            rta->rta_type = RTA_VIA;
+            rtvia = RTA_DATA(rta);
+            rtvia->rtvia_family = AF_INET6;
+            memcpy(rtvia->rtvia_addr, gate, sizeof(struct in6_addr));
+        } else if(ipv4) {
             rta = RTA_NEXT(rta, len);
             rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
             rta->rta_type = RTA_GATEWAY;
@@ -1078,6 +1431,61 @@ kernel_route(int operation, int table,
     return netlink_talk(&buf.nh);
 }
 
+/* Have the kernel resolve a neighbour's link-layer address now rather
+   than when the first packet is routed to it.  With NTF_USE, the entry is
+   created if necessary and probed if it is not reachable, but the kernel
+   keeps its own idea of its state. */
+int
+kernel_resolve_neighbour(const unsigned char *address, int ifindex)
+{
+    union { char raw[64]; struct nlmsghdr nh; } buf;
+    struct ndmsg *ndm;
+    struct rtattr *rta;
+    int rc, ipv4 = v4mapped(address);
+
+    if(!nl_setup) {
+        fprintf(stderr,"kernel_resolve_neighbour: netlink not initialized.\n");
+        errno = EIO;
+        return -1;
+    }
+
+    if(nl_command.sock < 0) {
+        rc = netlink_socket(&nl_command, 0);
+        if(rc < 0) {
+            int olderrno = errno;
+            perror("kernel_resolve_neighbour: netlink_socket()");
+            errno = olderrno;
+            return -1;
+        }
+    }
+
+    kdebugf("kernel_resolve_neighbour: %s on %d\n",
+            format_address(address), ifindex);
+
+    memset(buf.raw, 0, sizeof(buf.raw));
+    buf.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE;
+    buf.nh.nlmsg_type = RTM_NEWNEIGH;
+
+    ndm = NLMSG_DATA(&buf.nh);
+    ndm->ndm_family = ipv4 ? AF_INET : AF_INET6;
+    ndm->ndm_ifindex = ifindex;
+    ndm->ndm_state = NUD_NONE;
+    ndm->ndm_flags = NTF_USE;
+
+    rta = (void*)((char*)ndm + NLMSG_ALIGN(sizeof(struct ndmsg)));
+    rta->rta_type = NDA_DST;
+    if(ipv4) {
+        rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+        memcpy(RTA_DATA(rta), address + 12, sizeof(struct in_addr));
+    } else {
+        rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+        memcpy(RTA_DATA(rta), address, sizeof(struct in6_addr));
+    }
+    buf.nh.nlmsg_len = (char*)rta + rta->rta_len - buf.raw;
+
+    return netlink_talk(&buf.nh);
+}
+
 static int
 parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
 {
@@ -1111,6 +1519,13 @@ parse_kernel_route_rta(struct rtmsg *rtm, int len, struct kernel_route *route)
         case RTA_GATEWAY:
             COPY_ADDR(route->gw, rta, is_v4);
             break;
+        case RTA_VIA: {
+            struct rtvia *rtvia = RTA_DATA(rta);
+            if(rtvia->rtvia_family == AF_INET6 &&
+               RTA_PAYLOAD(rta) >= sizeof(struct rtvia) + 16)
+                memcpy(route->gw, rtvia->rtvia_addr, 16);
+            break;
+        }
         case RTA_OIF:
             route->ifindex = *(int*)RTA_DATA(rta);
             break;
@@ -1215,13 +1630,47 @@ filter_kernel_routes(struct nlmsghdr *nh, struct kernel_route *route)
 
 }
 
+/* Dump a single routing table.  With strict checking, the kernel only
+   sends us routes from that table, and leaves out cached routes. */
+static int
+kernel_dump_table(int family, int table, struct kernel_filter *filter)
+{
+    struct {
+        struct rtmsg rtm;
+        char attrs[RTA_SPACE(sizeof(int))];
+    } req;
+    struct rtattr *rta;
+    int rc;
+
+    memset(&req, 0, sizeof(req));
+    req.rtm.rtm_family = family;
+    req.rtm.rtm_table = RT_TABLE_UNSPEC;
+    rta = (struct rtattr*)req.attrs;
+    rta->rta_type = RTA_TABLE;
+    rta->rta_len = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(rta), &table, sizeof(int));
+
+    rc = netlink_send_dump(RTM_GETROUTE, &req, sizeof(req));
+    if(rc < 0)
+        return -1;
+
+    rc = netlink_read(&nl_command, NULL, 1, filter);
+    /* Tables are created lazily, an empty table does not exist. */
+    if(rc < 0 && errno == ENOENT)
+        return 0;
+    return rc;
+}
+
 /* This function should not return routes installed by us. */
 int
 kernel_dump(int operation, struct kernel_filter *filter)
 {
-    int i, rc;
+    int i, j, rc;
     int families[2] = { AF_INET6, AF_INET };
-    struct rtgenmsg g;
+    /* Strict checking requires the full header of each request type. */
+    struct rtmsg rtm;
+    struct fib_rule_hdr frh;
+    struct ifaddrmsg ifa;
 
     if(!nl_setup) {
         fprintf(stderr,"kernel_dump: netlink not initialized.\n");
@@ -1237,13 +1686,34 @@ kernel_dump(int operation, struct kernel_filter *filter)
             errno = save;
             return -1;
         }
+        netlink_strict(&nl_command);
     }
 
     for(i = 0; i < 2; i++) {
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = families[i];
-        if(operation & CHANGE_ROUTE) {
-            rc = netlink_send_dump(RTM_GETROUTE, &g, sizeof(g));
+        if((operation & CHANGE_ROUTE) && nl_strict) {
+            rc = 0;
+            for(j = 0; j < import_table_count; j++) {
+                rc = kernel_dump_table(families[i], import_tables[j], filter);
+                if(rc < 0)
+                    break;
+            }
+            if(rc < 0 && errno == EINVAL && j == 0) {
+                /* The kernel does not support filtered route dumps,
+                   fall back to dumping everything.  This is only safe
+                   for the first table, since the whole dump would
+                   deliver the routes of the tables already dumped a
+                   second time. */
+                kdebugf("Filtered route dump rejected, disabling.\n");
+                nl_strict = 0;
+            } else if(rc < 0) {
+                return -1;
+            }
+        }
+
+        if((operation & CHANGE_ROUTE) && !nl_strict) {
+            memset(&rtm, 0, sizeof(rtm));
+            rtm.rtm_family = families[i];
+            rc = netlink_send_dump(RTM_GETROUTE, &rtm, sizeof(rtm));
             if(rc < 0)
                 return -1;
 
@@ -1252,10 +1722,10 @@ kernel_dump(int operation, struct kernel_filter *filter)
                 return -1;
         }
 
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = families[i];
         if(operation & CHANGE_RULE) {
-            rc = netlink_send_dump(RTM_GETRULE, &g, sizeof(g));
+            memset(&frh, 0, sizeof(frh));
+            frh.family = families[i];
+            rc = netlink_send_dump(RTM_GETRULE, &frh, sizeof(frh));
             if(rc < 0)
                 return -1;
 
@@ -1266,9 +1736,9 @@ kernel_dump(int operation, struct kernel_filter *filter)
     }
 
     if(operation & CHANGE_ADDR) {
-        memset(&g, 0, sizeof(g));
-        g.rtgen_family = AF_UNSPEC;
-        rc = netlink_send_dump(RTM_GETADDR, &g, sizeof(g));
+        memset(&ifa, 0, sizeof(ifa));
+        ifa.ifa_family = AF_UNSPEC;
+        rc = netlink_send_dump(RTM_GETADDR, &ifa, sizeof(ifa));
         if(rc < 0)
             return -1;
 
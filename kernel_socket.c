@@ -294,6 +294,26 @@ kernel_setup_socket(int setup)
     }
 }
 
+int
+kernel_adopt_socket(int fd)
+{
+    kernel_socket = fd;
+    return kernel_setup_socket(1);
+}
+
+/* We don't carry the forwarding settings across upgrades on BSD. */
+int
+kernel_saved_setting(int i, const char **name_r, int *value_r)
+{
+    return 0;
+}
+
+int
+kernel_restore_setting(const char *name, int value)
+{
+    return -1;
+}
+
 int
 kernel_setup_interface(int setup, const char *ifname, int ifindex)
 {
@@ -403,6 +423,28 @@ kernel_has_ipv6_subtrees(void)
     return 0;
 }
 
+int
+kernel_has_v4viav6(void)
+{
+    return 0;
+}
+
+int
+kernel_sample_filter(void)
+{
+    return -1;
+}
+
+int
+kernel_notification_stats(unsigned int *received_r, unsigned int *ignored_r,
+                          unsigned int *rejected_r)
+{
+    *received_r = 0;
+    *ignored_r = 0;
+    *rejected_r = 0;
+    return 0;
+}
+
 int
 kernel_route(int operation, int table,
              const unsigned char *dest, unsigned short plen,
@@ -852,6 +894,14 @@ kernel_callback(struct kernel_filter *filter)
 
 }
 
+/* The BSD routing socket has no way to trigger neighbour resolution. */
+int
+kernel_resolve_neighbour(const unsigned char *address, int ifindex)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 int
 add_rule(int prio, const unsigned char *src_prefix, int src_plen, int table)
 {
@@ -0,0 +1,888 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* babel-loadgen: a load generator for testing babeld.  It brings up a
+   single interface using babeld's own code, keeps a neighbour
+   relationship alive with Hellos and IHUs, and announces a number of
+   prefixes from a number of router-ids at a fixed rate.  If it can see
+   the routing table of the babeld under test, it reports how long the
+   routes took to be installed (or removed). */
+
+/* For setns. */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+#include "babeld.h"
+#include "util.h"
+#include "net.h"
+#include "kernel.h"
+#include "interface.h"
+#include "neighbour.h"
+#include "message.h"
+
+/* The globals that babeld.c defines for the rest of the daemon. */
+struct timeval now;
+unsigned char myid[8];
+int have_id = 0;
+int debug = 0;
+int link_detect = 0;
+int all_wireless = 0;
+int has_ipv6_subtrees = 0;
+int has_v4viav6 = 0;
+int default_wireless_hello_interval = 4000;
+int default_wired_hello_interval = 4000;
+int resend_delay = -1;
+int random_id = 1;
+int do_daemonise = 0;
+int skip_kernel_setup = 1;
+int housekeeping_budget = 0;
+int timer_slack = 0;
+int receive_rate = 0;
+const char *logfile = NULL, *pidfile = NULL, *state_file = NULL;
+unsigned char *receive_buffer = NULL;
+int receive_buffer_size = 0;
+const unsigned char zeroes[16] = {0};
+int protocol_port;
+unsigned char protocol_group[16];
+int protocol_socket = -1;
+int kernel_socket = -1;
+unsigned int wakeups = 0, wakeup_rate = 0;
+
+static struct timeval check_neighbours_timeout;
+
+struct lg_route {
+    /* First announcement (or retraction) in the current phase. */
+    struct timeval sent;
+    char installed;
+    char done;
+};
+
+static struct interface *ifp;
+static struct lg_route *routes;
+static int num_routes = 1000, num_routers = 10, rate = 1000, metric = 0;
+static int wildcard = 0;
+static unsigned char base_prefix[16];
+static unsigned char base_plen, route_plen;
+static unsigned char (*router_ids)[8];
+static unsigned short *router_seqnos;
+
+/* A phase announces or retracts every route.  Each pass of a phase
+   sends every route once, at the configured rate. */
+static int announcing = 1, phase_count = 0, phase_reported = 1;
+static int phase_sent, phase_done;
+static struct timeval phase_start, phase_last;
+static unsigned *latencies;
+static int cursor;
+static struct timeval pass_start;
+
+static unsigned long long updates_sent = 0;
+static unsigned int requests_answered = 0;
+static int fib_socket = -1;
+
+static volatile sig_atomic_t exiting = 0;
+
+static void
+route_prefix(int i, unsigned char *prefix)
+{
+    int j, bit;
+
+    memcpy(prefix, base_prefix, 16);
+    for(j = base_plen; j < route_plen; j++) {
+        bit = (i >> (route_plen - 1 - j)) & 1;
+        if(bit)
+            prefix[j / 8] |= 0x80 >> (j % 8);
+    }
+}
+
+static int
+route_index(const unsigned char *prefix, unsigned char plen)
+{
+    int i = 0, j;
+
+    if(plen != route_plen || !in_prefix(prefix, base_prefix, base_plen))
+        return -1;
+    for(j = base_plen; j < route_plen; j++)
+        i = (i << 1) | !!(prefix[j / 8] & (0x80 >> (j % 8)));
+    return i < num_routes ? i : -1;
+}
+
+/* Consecutive routes share a router-id, which keeps updates compact. */
+static int
+route_router(int i)
+{
+    return (long long)i * num_routers / num_routes;
+}
+
+static void
+send_route(int i)
+{
+    unsigned char prefix[16];
+    int r = route_router(i);
+
+    route_prefix(i, prefix);
+    really_send_update(ifp, router_ids[r], prefix, route_plen, zeroes, 0,
+                       router_seqnos[r], announcing ? metric : INFINITY,
+                       NULL, -1);
+    if(routes[i].sent.tv_sec == 0) {
+        routes[i].sent = now;
+        phase_sent++;
+    }
+    updates_sent++;
+}
+
+static int
+compare_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void
+report_phase(void)
+{
+    unsigned elapsed;
+    int n = phase_done;
+
+    if(phase_reported)
+        return;
+    phase_reported = 1;
+
+    printf("%s %d: sent %d of %d routes",
+           announcing ? "announce" : "retract", phase_count,
+           phase_sent, num_routes);
+    if(fib_socket >= 0) {
+        elapsed = timeval_minus_msec(&phase_last, &phase_start);
+        printf(", %d %s", n, announcing ? "installed" : "removed");
+        if(n > 0) {
+            qsort(latencies, n, sizeof(unsigned), compare_unsigned);
+            printf(" in %u.%03us (%llu routes/s), "
+                   "latency min %u median %u 90%% %u max %u ms",
+                   elapsed / 1000, elapsed % 1000,
+                   elapsed > 0 ? (unsigned long long)n * 1000 / elapsed : 0,
+                   latencies[0], latencies[n / 2],
+                   latencies[n * 9 / 10], latencies[n - 1]);
+        }
+    }
+    printf(".\n");
+    fflush(stdout);
+}
+
+static void
+start_pass(void)
+{
+    cursor = 0;
+    pass_start = now;
+}
+
+static void
+start_phase(int announce)
+{
+    int i;
+
+    report_phase();
+
+    /* A route that was retracted is only feasible again with a newer
+       seqno. */
+    if(announce && phase_count > 0) {
+        for(i = 0; i < num_routers; i++)
+            router_seqnos[i] = seqno_plus(router_seqnos[i], 1);
+    }
+
+    announcing = announce;
+    phase_count++;
+    phase_reported = 0;
+    phase_sent = phase_done = 0;
+    phase_start = phase_last = now;
+    for(i = 0; i < num_routes; i++) {
+        routes[i].sent.tv_sec = routes[i].sent.tv_usec = 0;
+        routes[i].done = 0;
+    }
+    start_pass();
+
+    /* With -W, all routes are retracted by a single wildcard retraction,
+       which exercises babeld's bulk retraction. */
+    if(!announce && wildcard) {
+        send_wildcard_retraction(ifp);
+        for(i = 0; i < num_routes; i++)
+            routes[i].sent = now;
+        phase_sent = num_routes;
+        cursor = num_routes;
+    }
+}
+
+/* Send the routes that the rate allows since the start of the pass. */
+static void
+pace(void)
+{
+    unsigned long long allowed;
+
+    allowed = (unsigned long long)timeval_minus_msec(&now, &pass_start) *
+        rate / 1000 + 1;
+    while(cursor < num_routes && cursor < allowed)
+        send_route(cursor++);
+}
+
+static void
+fib_changed(const unsigned char *prefix, unsigned char plen, int add)
+{
+    struct lg_route *route;
+    int i;
+
+    i = route_index(prefix, plen);
+    if(i < 0)
+        return;
+
+    route = &routes[i];
+    if(route->installed == add)
+        return;
+    route->installed = add;
+
+    if(add != announcing || route->done || route->sent.tv_sec == 0)
+        return;
+    route->done = 1;
+    latencies[phase_done++] = timeval_minus_msec(&now, &route->sent);
+    phase_last = now;
+    if(phase_done >= num_routes)
+        report_phase();
+}
+
+#ifdef __linux__
+
+/* kernel.c ignores our own protocol's routes, which are the ones we are
+   interested in, so we use a netlink socket of our own.  It is opened
+   in the namespace of the babeld under test if there is one. */
+static int
+fib_monitor_socket(const char *netns)
+{
+    struct sockaddr_nl snl;
+    int s, rc, self = -1, ns = -1, size = 1024 * 1024;
+
+    if(netns) {
+        self = open("/proc/self/ns/net", O_RDONLY);
+        if(self < 0) {
+            perror("open(/proc/self/ns/net)");
+            return -1;
+        }
+        ns = open(netns, O_RDONLY);
+        if(ns < 0) {
+            perror("open(netns)");
+            close(self);
+            return -1;
+        }
+        rc = setns(ns, CLONE_NEWNET);
+        close(ns);
+        if(rc < 0) {
+            perror("setns");
+            close(self);
+            return -1;
+        }
+    }
+
+    s = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(s >= 0) {
+        memset(&snl, 0, sizeof(snl));
+        snl.nl_family = AF_NETLINK;
+        snl.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
+        rc = bind(s, (struct sockaddr*)&snl, sizeof(snl));
+        if(rc < 0) {
+            perror("bind(netlink)");
+            close(s);
+            s = -1;
+        }
+    } else {
+        perror("socket(netlink)");
+    }
+
+    if(netns) {
+        rc = setns(self, CLONE_NEWNET);
+        close(self);
+        if(rc < 0) {
+            perror("setns(self)");
+            exit(1);
+        }
+    }
+
+    if(s >= 0) {
+        rc = setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        if(rc < 0)
+            perror("setsockopt(SO_RCVBUF)");
+    }
+    return s;
+}
+
+static void
+fib_monitor_read(int s)
+{
+    static unsigned char buf[65536];
+    struct nlmsghdr *nh;
+    struct rtmsg *rtm;
+    struct rtattr *rta;
+    unsigned char prefix[16];
+    int len, alen, v4;
+
+    len = recv(s, buf, sizeof(buf), 0);
+    if(len < 0) {
+        if(errno == ENOBUFS)
+            fprintf(stderr, "Warning: lost routing table notifications.\n");
+        else if(errno != EAGAIN && errno != EINTR)
+            perror("recv(netlink)");
+        return;
+    }
+
+    for(nh = (struct nlmsghdr*)buf; NLMSG_OK(nh, len);
+        nh = NLMSG_NEXT(nh, len)) {
+        if(nh->nlmsg_type != RTM_NEWROUTE && nh->nlmsg_type != RTM_DELROUTE)
+            continue;
+        rtm = NLMSG_DATA(nh);
+        if(rtm->rtm_protocol != RTPROT_BABEL)
+            continue;
+        if(rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+            continue;
+        v4 = rtm->rtm_family == AF_INET;
+        if(v4)
+            v4tov6(prefix, zeroes);
+        else
+            memset(prefix, 0, 16);
+        alen = RTM_PAYLOAD(nh);
+        for(rta = RTM_RTA(rtm); RTA_OK(rta, alen);
+            rta = RTA_NEXT(rta, alen)) {
+            if(rta->rta_type != RTA_DST)
+                continue;
+            if(v4)
+                v4tov6(prefix, RTA_DATA(rta));
+            else
+                memcpy(prefix, RTA_DATA(rta), 16);
+        }
+        fib_changed(prefix, rtm->rtm_dst_len + (v4 ? 96 : 0),
+                    nh->nlmsg_type == RTM_NEWROUTE);
+    }
+}
+
+#else
+
+static int
+fib_monitor_socket(const char *netns)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static void
+fib_monitor_read(int s)
+{
+    return;
+}
+
+#endif
+
+/* Wildcard requests restart the current pass, requests for one of our
+   routes are answered at once, bumping the seqno if asked to. */
+static void
+handle_requests(const unsigned char *packet, int packetlen)
+{
+    const unsigned char *message;
+    unsigned char prefix[16], plen;
+    unsigned short seqno;
+    int i, j, r, rc, len, bodylen;
+
+    if(packetlen < 4 || packet[0] != 42 || packet[1] != 2)
+        return;
+
+    DO_NTOHS(bodylen, packet + 2);
+    bodylen = MIN(bodylen, packetlen - 4);
+
+    i = 0;
+    while(i < bodylen) {
+        message = packet + 4 + i;
+        if(message[0] == MESSAGE_PAD1) {
+            i++;
+            continue;
+        }
+        if(i + 1 >= bodylen)
+            break;
+        len = message[1];
+        if(i + len + 2 > bodylen)
+            break;
+
+        if(message[0] == MESSAGE_REQUEST && len >= 2) {
+            if(message[2] == 0) {
+                if(cursor >= num_routes && (announcing || !wildcard))
+                    start_pass();
+                requests_answered++;
+            } else {
+                rc = network_prefix(message[2], message[3], 0,
+                                    message + 4, NULL, len - 2, prefix);
+                plen = message[3] +
+                    (message[2] == 1 || message[2] == 4 ? 96 : 0);
+                j = rc < 0 ? -1 : route_index(prefix, plen);
+                if(j >= 0 && routes[j].sent.tv_sec != 0) {
+                    send_route(j);
+                    requests_answered++;
+                }
+            }
+        } else if(message[0] == MESSAGE_MH_REQUEST && len >= 14) {
+            DO_NTOHS(seqno, message + 4);
+            rc = network_prefix(message[2], message[3], 0,
+                                message + 16, NULL, len - 14, prefix);
+            plen = message[3] + (message[2] == 1 || message[2] == 4 ? 96 : 0);
+            j = rc < 0 ? -1 : route_index(prefix, plen);
+            if(j >= 0 && routes[j].sent.tv_sec != 0) {
+                r = route_router(j);
+                if(memcmp(message + 8, router_ids[r], 8) == 0 &&
+                   seqno_compare(seqno, router_seqnos[r]) > 0)
+                    router_seqnos[r] = seqno_plus(router_seqnos[r], 1);
+                send_route(j);
+                requests_answered++;
+            }
+        }
+        i += len + 2;
+    }
+}
+
+static struct neighbour *
+ready_neighbour(void)
+{
+    struct neighbour *neigh;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp == ifp && neigh->txcost < INFINITY)
+            return neigh;
+    }
+    return NULL;
+}
+
+void
+schedule_neighbours_check(int msecs, int override)
+{
+    struct timeval timeout;
+
+    timeval_add_msec(&timeout, &now, roughly(msecs));
+    if(override)
+        check_neighbours_timeout = timeout;
+    else
+        timeval_min(&check_neighbours_timeout, &timeout);
+}
+
+void
+schedule_interfaces_check(int msecs, int override)
+{
+    return;
+}
+
+int
+resize_receive_buffer(int size)
+{
+    unsigned char *new;
+
+    if(size <= receive_buffer_size)
+        return 0;
+
+    new = realloc(receive_buffer, size);
+    if(new == NULL) {
+        perror("realloc(receive_buffer)");
+        return -1;
+    }
+    receive_buffer = new;
+    receive_buffer_size = size;
+    return 1;
+}
+
+static void
+sigexit(int signo)
+{
+    exiting = 1;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Syntax: babel-loadgen "
+            "[-m multicast_address] [-p port] [-h hello]\n"
+            "                "
+            "[-n routes] [-r routers] [-R rate] [-M metric]\n"
+            "                "
+            "[-b prefix] [-l plen] [-u update] [-f flap] [-W] [-t duration]\n"
+            "                "
+            "[-N netns] [-d level] interface\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_in6 sin6;
+    struct timeval tv, deadline = {0, 0}, flap_time;
+    struct neighbour *neigh;
+    struct sigaction sa;
+    fd_set readfds;
+    const char *netns = NULL;
+    unsigned int seed;
+    int opt, rc, i, maxfd, started = 0;
+    int plen = -1, update_interval = 60000, flap_interval = 0, duration = 0;
+    int af;
+
+    gettime(&now);
+
+    rc = read_random_bytes(&seed, sizeof(seed));
+    if(rc < 0) {
+        perror("read(random)");
+        seed = 42;
+    }
+    seed ^= (now.tv_sec ^ now.tv_usec);
+    srandom(seed);
+
+    parse_address("ff02:0:0:0:0:0:1:6", protocol_group, NULL);
+    protocol_port = 6696;
+    parse_net("2001:db8::/32", base_prefix, &base_plen, &af);
+
+    while(1) {
+        opt = getopt(argc, argv, "m:p:h:n:r:R:M:b:l:u:f:Wt:N:d:");
+        if(opt < 0)
+            break;
+
+        switch(opt) {
+        case 'm':
+            rc = parse_address(optarg, protocol_group, NULL);
+            if(rc < 0 || protocol_group[0] != 0xff)
+                goto usage;
+            break;
+        case 'p':
+            protocol_port = parse_nat(optarg);
+            if(protocol_port <= 0 || protocol_port > 0xFFFF)
+                goto usage;
+            break;
+        case 'h':
+            default_wireless_hello_interval = parse_thousands(optarg);
+            if(default_wireless_hello_interval <= 0 ||
+               default_wireless_hello_interval > 0xFFFF * 10)
+                goto usage;
+            default_wired_hello_interval = default_wireless_hello_interval;
+            break;
+        case 'n':
+            num_routes = parse_nat(optarg);
+            if(num_routes <= 0)
+                goto usage;
+            break;
+        case 'r':
+            num_routers = parse_nat(optarg);
+            if(num_routers <= 0 || num_routers > 0xFFFF)
+                goto usage;
+            break;
+        case 'R':
+            rate = parse_nat(optarg);
+            if(rate <= 0)
+                goto usage;
+            break;
+        case 'M':
+            metric = parse_nat(optarg);
+            if(metric < 0 || metric >= INFINITY)
+                goto usage;
+            break;
+        case 'b':
+            rc = parse_net(optarg, base_prefix, &base_plen, &af);
+            if(rc < 0)
+                goto usage;
+            break;
+        case 'l':
+            plen = parse_nat(optarg);
+            if(plen < 0 || plen > 128)
+                goto usage;
+            break;
+        case 'u':
+            update_interval = parse_thousands(optarg);
+            if(update_interval <= 0 || update_interval > 0xFFFF * 10)
+                goto usage;
+            break;
+        case 'f':
+            flap_interval = parse_thousands(optarg);
+            if(flap_interval < 0)
+                goto usage;
+            break;
+        case 'W':
+            wildcard = 1;
+            break;
+        case 't':
+            duration = parse_thousands(optarg);
+            if(duration < 0)
+                goto usage;
+            break;
+        case 'N':
+            netns = optarg;
+            break;
+        case 'd':
+            debug = parse_nat(optarg);
+            if(debug < 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if(optind != argc - 1)
+        goto usage;
+
+    if(num_routers > num_routes)
+        num_routers = num_routes;
+
+    if(plen < 0)
+        route_plen = v4mapped(base_prefix) ? 120 : 64;
+    else
+        route_plen = plen + (v4mapped(base_prefix) ? 96 : 0);
+    if(route_plen <= base_plen || route_plen > 128 ||
+       (route_plen - base_plen < 31 &&
+        num_routes > (1 << (route_plen - base_plen)))) {
+        fprintf(stderr, "Cannot fit %d routes of length %d in %s.\n",
+                num_routes, route_plen, format_prefix(base_prefix, base_plen));
+        exit(1);
+    }
+
+    routes = calloc(num_routes, sizeof(struct lg_route));
+    latencies = calloc(num_routes, sizeof(unsigned));
+    router_ids = calloc(num_routers, 8);
+    router_seqnos = calloc(num_routers, sizeof(unsigned short));
+    if(routes == NULL || latencies == NULL ||
+       router_ids == NULL || router_seqnos == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    rc = read_random_bytes(myid, 8);
+    if(rc < 0) {
+        perror("read(random)");
+        exit(1);
+    }
+    myid[0] &= ~3;
+    have_id = 1;
+    for(i = 0; i < num_routers; i++) {
+        memcpy(router_ids[i], myid, 8);
+        DO_HTONS(router_ids[i] + 6, i);
+        router_seqnos[i] = random() & 0xFFFF;
+    }
+
+    rc = kernel_setup(1);
+    if(rc < 0) {
+        fprintf(stderr, "kernel_setup failed.\n");
+        exit(1);
+    }
+
+    protocol_socket = babel_socket(protocol_port);
+    if(protocol_socket < 0) {
+        perror("Couldn't create link local socket");
+        exit(1);
+    }
+
+    rc = resize_receive_buffer(1500);
+    if(rc < 0)
+        exit(1);
+
+    ifp = add_interface(argv[optind], NULL);
+    if(ifp == NULL) {
+        perror("add_interface");
+        exit(1);
+    }
+    check_interfaces(0);
+    if(!if_up(ifp)) {
+        fprintf(stderr, "Couldn't bring up interface %s.\n", ifp->name);
+        exit(1);
+    }
+    /* Our routes are refreshed every update_interval, not hello * 4. */
+    ifp->update_interval = update_interval;
+
+    fib_socket = fib_monitor_socket(netns);
+    if(fib_socket < 0) {
+        if(netns)
+            exit(1);
+        fprintf(stderr,
+                "Warning: couldn't monitor the routing table, "
+                "latency will not be measured.\n");
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigexit;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if(duration > 0)
+        timeval_add_msec(&deadline, &now, duration);
+    schedule_neighbours_check(5000, 1);
+    flap_time.tv_sec = flap_time.tv_usec = 0;
+
+    printf("Announcing %d routes from %d router-ids at %d routes/s "
+           "on %s, waiting for a neighbour.\n",
+           num_routes, num_routers, rate, ifp->name);
+    fflush(stdout);
+
+    while(!exiting) {
+        gettime(&now);
+
+        tv = ifp->hello_timeout;
+        timeval_min(&tv, &ifp->flush_timeout);
+        timeval_min(&tv, &unicast_flush_timeout);
+        timeval_min(&tv, &check_neighbours_timeout);
+        timeval_min(&tv, &deadline);
+        if(started) {
+            struct timeval t;
+            if(cursor < num_routes)
+                timeval_add_msec(&t, &pass_start,
+                                 ((unsigned long long)cursor * 1000 +
+                                  rate - 1) / rate);
+            else if(announcing)
+                timeval_add_msec(&t, &pass_start, update_interval);
+            else
+                t = tv;
+            timeval_min(&tv, &t);
+            timeval_min(&tv, &flap_time);
+        }
+
+        FD_ZERO(&readfds);
+        FD_SET(protocol_socket, &readfds);
+        maxfd = protocol_socket;
+        if(fib_socket >= 0) {
+            FD_SET(fib_socket, &readfds);
+            maxfd = MAX(maxfd, fib_socket);
+        }
+
+        if(timeval_compare(&tv, &now) > 0) {
+            timeval_minus(&tv, &tv, &now);
+            rc = select(maxfd + 1, &readfds, NULL, NULL, &tv);
+            if(rc < 0) {
+                if(errno != EINTR) {
+                    perror("select");
+                    sleep(1);
+                }
+                FD_ZERO(&readfds);
+            }
+        } else {
+            FD_ZERO(&readfds);
+        }
+
+        gettime(&now);
+
+        if(FD_ISSET(protocol_socket, &readfds)) {
+            rc = babel_recv(protocol_socket,
+                            receive_buffer, receive_buffer_size,
+                            (struct sockaddr*)&sin6, sizeof(sin6));
+            if(rc < 0) {
+                if(errno != EAGAIN && errno != EINTR)
+                    perror("recv");
+            } else if(sin6.sin6_scope_id == ifp->ifindex) {
+                parse_packet((unsigned char*)&sin6.sin6_addr, ifp,
+                             receive_buffer, rc, PARSE_LINK);
+                if(started)
+                    handle_requests(receive_buffer, rc);
+            }
+        }
+
+        if(fib_socket >= 0 && FD_ISSET(fib_socket, &readfds))
+            fib_monitor_read(fib_socket);
+
+        if(!started) {
+            neigh = ready_neighbour();
+            if(neigh) {
+                printf("Neighbour %s is up.\n", format_address(neigh->address));
+                started = 1;
+                start_phase(1);
+                if(flap_interval > 0)
+                    timeval_add_msec(&flap_time, &now, flap_interval);
+            }
+        }
+
+        if(started) {
+            if(flap_interval > 0 && timeval_compare(&flap_time, &now) <= 0) {
+                start_phase(!announcing);
+                timeval_add_msec(&flap_time, &now, flap_interval);
+            } else if(announcing && cursor >= num_routes &&
+                      timeval_minus_msec(&now, &pass_start) >=
+                      update_interval) {
+                start_pass();
+            }
+            pace();
+        }
+
+        if(deadline.tv_sec != 0 && timeval_compare(&deadline, &now) <= 0)
+            break;
+
+        if(timeval_compare(&check_neighbours_timeout, &now) < 0) {
+            int msecs;
+            msecs = check_neighbours();
+            msecs = MAX(3 * msecs / 2, 10);
+            schedule_neighbours_check(msecs, 1);
+        }
+
+        if(timeval_compare(&now, &ifp->hello_timeout) >= 0)
+            send_hello(ifp);
+
+        if(ifp->flush_timeout.tv_sec != 0 &&
+           timeval_compare(&now, &ifp->flush_timeout) >= 0)
+            flushbuf(ifp);
+
+        if(unicast_flush_timeout.tv_sec != 0 &&
+           timeval_compare(&now, &unicast_flush_timeout) >= 0)
+            flush_unicast(1);
+    }
+
+    if(started) {
+        report_phase();
+        if(announcing) {
+            announcing = 0;
+            if(wildcard) {
+                send_wildcard_retraction(ifp);
+            } else {
+                for(i = 0; i < num_routes; i++)
+                    send_route(i);
+            }
+        }
+    }
+    flushbuf(ifp);
+    flush_unicast(1);
+
+    printf("Sent %llu updates in %llu packets (%llu bytes), "
+           "answered %u requests.\n",
+           updates_sent, ifp->flushed_packets,
+           ifp->multicast_bytes + ifp->unicast_bytes, requests_answered);
+    return 0;
+
+ usage:
+    usage();
+    return 1;
+}
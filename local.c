@@ -36,6 +36,10 @@ THE SOFTWARE.
 #include "route.h"
 #include "util.h"
 #include "local.h"
+#include "damping.h"
+#include "message.h"
+#include "handoff.h"
+#include "profile.h"
 #include "version.h"
 
 #ifdef NO_LOCAL_INTERFACE
@@ -47,19 +51,34 @@ int dummy;
 int local_server_socket = -1, local_sockets[MAX_LOCAL_SOCKETS];
 int num_local_sockets = 0;
 int local_server_port = -1;
+int local_server_write = 0;
+
+static int local_command(int s, const char *command);
 
 int
 local_read(int s)
 {
     int rc;
-    char buf[500];
+    char buf[500], *p, *q;
 
-    /* Ignore anything that comes in, except for EOF */
-    rc = read(s, buf, 500);
+    rc = read(s, buf, 499);
 
     if(rc <= 0)
         return rc;
 
+    /* Commands are short lines, we don't bother with commands that
+       straddle reads. */
+    buf[rc] = '\0';
+    p = buf;
+    while(p) {
+        q = strpbrk(p, "\r\n");
+        if(q)
+            *q++ = '\0';
+        if(*p != '\0')
+            local_command(s, p);
+        p = q;
+    }
+
     return 1;
 }
 
@@ -156,7 +175,7 @@ local_notify_neighbour_1(int s, struct neighbour *neigh, int kind)
                   (unsigned long int)neigh,
                   format_address(neigh->address),
                   neigh->ifp->name,
-                  neigh->reach,
+                  neighbour_reach(neigh),
                   neighbour_rxcost(neigh),
                   neighbour_txcost(neigh),
                   rttbuf,
@@ -319,4 +338,257 @@ local_notify_all_1(int s)
     return;
 }
 
+static void
+local_notify_damping_1(int s)
+{
+    char buf[512];
+    int rc = 0;
+    struct damping_stream *dampings;
+
+    dampings = damping_stream();
+    if(dampings == NULL)
+        goto fail;
+
+    while(1) {
+        struct damping *d = damping_stream_next(dampings);
+        if(d == NULL)
+            break;
+        rc = snprintf(buf, 512,
+                      "damping prefix %s from %s penalty %d "
+                      "suppressed %s pending %s\n",
+                      format_prefix(d->prefix, d->plen),
+                      format_prefix(d->src_prefix, d->src_plen),
+                      d->penalty,
+                      d->suppressed ? "yes" : "no",
+                      d->pending ? "yes" : "no");
+        if(rc < 0 || rc >= 512)
+            break;
+        rc = write_timeout(s, buf, rc);
+        if(rc < 0)
+            break;
+    }
+    damping_stream_done(dampings);
+    if(rc < 0)
+        goto fail;
+
+    rc = write_timeout(s, "done\n", 5);
+    if(rc < 0)
+        goto fail;
+    return;
+
+ fail:
+    shutdown(s, 1);
+    return;
+}
+
+static void
+local_notify_stats_1(int s)
+{
+    char buf[512];
+    unsigned int received, ignored, rejected;
+    unsigned long long airtime;
+    unsigned int fill, delay;
+    int rc, filtered;
+    struct interface *ifp;
+    struct neighbour *neigh;
+
+    filtered = kernel_notification_stats(&received, &ignored, &rejected);
+    rc = snprintf(buf, 512,
+                  "wakeups %u\n"
+                  "wakeups-per-second %u.%02u\n"
+                  "kernel-notifications %u\n"
+                  "kernel-notifications-ignored %u\n"
+                  "kernel-notifications-filtered %s\n"
+                  "kernel-notifications-rejected %u\n",
+                  wakeups, wakeup_rate / 100, wakeup_rate % 100,
+                  received, ignored, filtered ? "yes" : "no", rejected);
+    if(rc < 0 || rc >= 512)
+        goto fail;
+    rc = write_timeout(s, buf, rc);
+    if(rc < 0)
+        goto fail;
+
+    FOR_ALL_INTERFACES(ifp) {
+        if((ifp->flags & IF_WIRED))
+            airtime = 0;
+        else
+            airtime = ifp->multicast_bytes * RATE_CLASS_MULTICAST +
+                ifp->unicast_bytes * RATE_CLASS_UNICAST;
+        /* Averages per packet, in hundredths and milliseconds. */
+        fill = delay = 0;
+        if(ifp->flushed_packets > 0) {
+            fill = ifp->fill_total / 10 / ifp->flushed_packets;
+            delay = ifp->delay_total / ifp->flushed_packets;
+        }
+        rc = snprintf(buf, 512,
+                      "interface %s bytes %llu multicast-bytes %llu "
+                      "unicast-bytes %llu airtime %llu packets %llu "
+                      "fill-ratio %u.%02u queueing-delay %u\n",
+                      ifp->name, ifp->multicast_bytes + ifp->unicast_bytes,
+                      ifp->multicast_bytes, ifp->unicast_bytes,
+                      airtime, ifp->flushed_packets,
+                      fill / 100, fill % 100, delay);
+        if(rc < 0 || rc >= 512)
+            goto fail;
+        rc = write_timeout(s, buf, rc);
+        if(rc < 0)
+            goto fail;
+    }
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        rc = snprintf(buf, 512,
+                      "neighbour %s if %s backlog %d deferred %u dropped %u\n",
+                      format_address(neigh->address), neigh->ifp->name,
+                      neigh->backlog_len, neigh->deferred, neigh->dropped);
+        if(rc < 0 || rc >= 512)
+            goto fail;
+        rc = write_timeout(s, buf, rc);
+        if(rc < 0)
+            goto fail;
+    }
+
+    rc = write_timeout(s, "done\n", 5);
+    if(rc < 0)
+        goto fail;
+    return;
+
+ fail:
+    shutdown(s, 1);
+    return;
+}
+
+/* Stacks are folded, root first, as expected by flame graph tools. */
+static void
+local_notify_profile_1(int s)
+{
+    char buf[1024];
+    int rc = 0, i, n;
+    struct profile_stream *stream;
+    struct profile_stack *stack;
+
+    profile_stop();
+    stream = profile_stream();
+    if(stream == NULL)
+        goto fail;
+
+    while(1) {
+        stack = profile_stream_next(stream);
+        if(stack == NULL)
+            break;
+        n = 0;
+        for(i = stack->depth - 1; i >= 0; i--) {
+            rc = format_frame(buf + n, 1024 - n, stack->pcs[i]);
+            if(rc < 0 || rc >= 1024 - n - 1)
+                break;
+            n += rc;
+            buf[n++] = i > 0 ? ';' : ' ';
+        }
+        if(i >= 0)
+            continue;
+        rc = snprintf(buf + n, 1024 - n, "%d\n", stack->count);
+        if(rc < 0 || rc >= 1024 - n)
+            continue;
+        rc = write_timeout(s, buf, n + rc);
+        if(rc < 0)
+            break;
+    }
+    profile_stream_done(stream);
+    if(rc < 0)
+        goto fail;
+
+    rc = write_timeout(s, "done\n", 5);
+    if(rc < 0)
+        goto fail;
+    return;
+
+ fail:
+    shutdown(s, 1);
+    return;
+}
+
+/* Commands that change the state of the daemon are only accepted on a
+   read-write local interface.  Returns 1 if the command was refused. */
+static int
+local_readonly(int s)
+{
+    int rc;
+
+    if(local_server_write)
+        return 0;
+
+    rc = write_timeout(s, "bad\n", 4);
+    if(rc < 0)
+        shutdown(s, 1);
+    return 1;
+}
+
+static int
+local_command(int s, const char *command)
+{
+    int rc;
+
+    if(strcmp(command, "damping") == 0) {
+        local_notify_damping_1(s);
+        return 1;
+    }
+
+    if(strcmp(command, "stats") == 0) {
+        local_notify_stats_1(s);
+        return 1;
+    }
+
+    if(strcmp(command, "profile start") == 0) {
+        if(local_readonly(s))
+            return 1;
+        rc = profile_start();
+        if(rc < 0)
+            rc = write_timeout(s, "bad\n", 4);
+        else
+            rc = write_timeout(s, "ok\n", 3);
+        if(rc < 0)
+            shutdown(s, 1);
+        return 1;
+    }
+
+    if(strcmp(command, "profile stop") == 0) {
+        if(local_readonly(s))
+            return 1;
+        local_notify_profile_1(s);
+        return 1;
+    }
+
+    if(strncmp(command, "request ", 8) == 0) {
+        unsigned char prefix[16], plen;
+        int af;
+        if(local_readonly(s))
+            return 1;
+        rc = parse_net(command + 8, prefix, &plen, &af);
+        if(rc < 0) {
+            rc = write_timeout(s, "bad\n", 4);
+        } else {
+            send_request_range(NULL, prefix, plen);
+            rc = write_timeout(s, "ok\n", 3);
+        }
+        if(rc < 0)
+            shutdown(s, 1);
+        return 1;
+    }
+
+    if(strcmp(command, "upgrade") == 0) {
+        if(local_readonly(s))
+            return 1;
+        /* Done from the main loop, once we're done with this socket. */
+        handoff_requested = 1;
+        rc = write_timeout(s, "ok\n", 3);
+        if(rc < 0)
+            shutdown(s, 1);
+        return 1;
+    }
+
+    rc = write_timeout(s, "bad\n", 4);
+    if(rc < 0)
+        shutdown(s, 1);
+    return 0;
+}
+
 #endif
@@ -40,6 +40,7 @@ THE SOFTWARE.
 #include "resend.h"
 #include "message.h"
 #include "configuration.h"
+#include "digest.h"
 
 unsigned char packet_header[4] = {42, 2};
 
@@ -49,17 +50,39 @@ unsigned short myseqno = 0;
 struct timeval seqno_time = {0, 0};
 
 #define UNICAST_BUFSIZE 1024
+
+/* A buffer with less room than this is considered full. */
+#define FLUSH_FULL_SPACE 64
+/* How long to hold a packet that is unlikely to grow. */
+#define FLUSH_IDLE_DELAY 20
 int unicast_buffered = 0;
 unsigned char *unicast_buffer = NULL;
 struct neighbour *unicast_neighbour = NULL;
 struct timeval unicast_flush_timeout = {0, 0};
 
+/* Packets from a neighbour that exceeded receive-rate. */
+struct deferred_packet {
+    struct deferred_packet *next;
+    unsigned char *packet;
+    int len;
+};
+
+struct timeval receive_backlog_time = {0, 0};
+
 static const unsigned char v4prefix[16] =
     {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0 };
 
+/* AE 4 is an IPv4 prefix with an IPv6 next hop (RFC 9229).  It shares
+   the IPv4 prefix compression state. */
+static int
+ae_is_v4(int ae)
+{
+    return ae == 1 || ae == 4;
+}
+
 /* Parse a network prefix, encoded in the somewhat baroque compressed
    representation used by Babel.  Return the number of bytes parsed. */
-static int
+int
 network_prefix(int ae, int plen, unsigned int omitted,
                const unsigned char *p, const unsigned char *dp,
                unsigned int len, unsigned char *p_r)
@@ -70,7 +93,7 @@ network_prefix(int ae, int plen, unsigned int omitted,
 
     if(plen >= 0)
         pb = (plen + 7) / 8;
-    else if(ae == 1)
+    else if(ae == 1 || ae == 4)
         pb = 4;
     else
         pb = 16;
@@ -84,6 +107,11 @@ network_prefix(int ae, int plen, unsigned int omitted,
     case 0:
         ret = 0;
         break;
+    case 4:
+        /* Only valid for prefixes, not for addresses. */
+        if(plen < 0)
+            return -1;
+        /* Fall through. */
     case 1:
         if(omitted > 4 || pb > 4 || (pb > omitted && len < pb - omitted))
             return -1;
@@ -115,7 +143,8 @@ network_prefix(int ae, int plen, unsigned int omitted,
         return -1;
     }
 
-    mask_prefix(p_r, prefix, plen < 0 ? 128 : ae == 1 ? plen + 96 : plen);
+    mask_prefix(p_r, prefix,
+                plen < 0 ? 128 : ae_is_v4(ae) ? plen + 96 : plen);
     return ret;
 }
 
@@ -168,12 +197,13 @@ parse_update_subtlv(const unsigned char *a, int alen,
 
 static int
 parse_hello_subtlv(const unsigned char *a, int alen,
-                   unsigned int *hello_send_us)
+                   unsigned int *hello_send_us,
+                   const unsigned char **digest_r, int *digest_len_r)
 {
     int type, len, i = 0, ret = 0;
 
     while(i < alen) {
-        type = a[0];
+        type = a[i];
         if(type == SUBTLV_PAD1) {
             i++;
             continue;
@@ -184,7 +214,7 @@ parse_hello_subtlv(const unsigned char *a, int alen,
             return -1;
         }
         len = a[i + 1];
-        if(i + len > alen) {
+        if(i + len + 2 > alen) {
             fprintf(stderr, "Received truncated sub-TLV on Hello message.\n");
             return -1;
         }
@@ -199,6 +229,9 @@ parse_hello_subtlv(const unsigned char *a, int alen,
                 fprintf(stderr,
                         "Received incorrect RTT sub-TLV on Hello message.\n");
             }
+        } else if(type == SUBTLV_DIGEST) {
+            *digest_r = a + i + 2;
+            *digest_len_r = len;
         } else {
             debugf("Received unknown Hello sub-TLV type %d.\n", type);
         }
@@ -211,12 +244,13 @@ parse_hello_subtlv(const unsigned char *a, int alen,
 static int
 parse_ihu_subtlv(const unsigned char *a, int alen,
                  unsigned int *hello_send_us,
-                 unsigned int *hello_rtt_receive_time)
+                 unsigned int *hello_rtt_receive_time,
+                 const unsigned char **digest_r, int *digest_len_r)
 {
     int type, len, i = 0, ret = 0;
 
     while(i < alen) {
-        type = a[0];
+        type = a[i];
         if(type == SUBTLV_PAD1) {
             i++;
             continue;
@@ -227,7 +261,7 @@ parse_ihu_subtlv(const unsigned char *a, int alen,
             return -1;
         }
         len = a[i + 1];
-        if(i + len > alen) {
+        if(i + len + 2 > alen) {
             fprintf(stderr, "Received truncated sub-TLV on IHU message.\n");
             return -1;
         }
@@ -244,6 +278,9 @@ parse_ihu_subtlv(const unsigned char *a, int alen,
                 fprintf(stderr,
                         "Received incorrect RTT sub-TLV on IHU message.\n");
             }
+        } else if(type == SUBTLV_DIGEST) {
+            *digest_r = a + i + 2;
+            *digest_len_r = len;
         } else {
             debugf("Received unknown IHU sub-TLV type %d.\n", type);
         }
@@ -253,6 +290,42 @@ parse_ihu_subtlv(const unsigned char *a, int alen,
     return ret;
 }
 
+static void
+parse_request_subtlv(const unsigned char *a, int alen,
+                     const unsigned char **digest_r, int *digest_len_r,
+                     const unsigned char **range_r, int *range_len_r)
+{
+    int type, len, i = 0;
+
+    while(i < alen) {
+        type = a[i];
+        if(type == SUBTLV_PAD1) {
+            i++;
+            continue;
+        }
+
+        if(i + 1 >= alen || i + a[i + 1] + 2 > alen) {
+            fprintf(stderr, "Received truncated sub-TLV on request.\n");
+            return;
+        }
+        len = a[i + 1];
+
+        if(type == SUBTLV_PADN) {
+            /* Nothing to do. */
+        } else if(type == SUBTLV_DIGEST) {
+            *digest_r = a + i + 2;
+            *digest_len_r = len;
+        } else if(type == SUBTLV_PREFIX_RANGE) {
+            *range_r = a + i + 2;
+            *range_len_r = len;
+        } else {
+            debugf("Received unknown request sub-TLV type %d.\n", type);
+        }
+
+        i += len + 2;
+    }
+}
+
 static int
 network_address(int ae, const unsigned char *a, unsigned int len,
                 unsigned char *a_r)
@@ -269,7 +342,7 @@ channels_len(unsigned char *channels)
 
 void
 parse_packet(const unsigned char *from, struct interface *ifp,
-             const unsigned char *packet, int packetlen)
+             const unsigned char *packet, int packetlen, int which)
 {
     int i;
     const unsigned char *message;
@@ -342,6 +415,10 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             break;
         }
 
+        if(!(which & ((type == MESSAGE_HELLO || type == MESSAGE_IHU) ?
+                      PARSE_LINK : PARSE_OTHER)))
+            goto done;
+
         if(type == MESSAGE_PADN) {
             debugf("Received pad%d from %s on %s.\n",
                    len, format_address(from), ifp->name);
@@ -358,31 +435,57 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                    format_address(from), ifp->name);
             /* Nothing right now */
         } else if(type == MESSAGE_HELLO) {
-            unsigned short seqno, interval;
+            unsigned short flags, seqno, interval;
             int changed;
             unsigned int timestamp;
+            const unsigned char *digest = NULL;
+            int digest_len = -1;
             if(len < 6) goto fail;
+            DO_NTOHS(flags, message + 2);
             DO_NTOHS(seqno, message + 4);
             DO_NTOHS(interval, message + 6);
-            debugf("Received hello %d (%d) from %s on %s.\n",
+            debugf("Received %shello %d (%d) from %s on %s.\n",
+                   (flags & HELLO_FLAG_UNICAST) ? "unicast " : "",
                    seqno, interval,
                    format_address(from), ifp->name);
-            changed = update_neighbour(neigh, seqno, interval);
+            changed = update_neighbour(neigh,
+                                       (flags & HELLO_FLAG_UNICAST) ?
+                                       &neigh->uhello : &neigh->hello,
+                                       seqno, interval);
             update_neighbour_metric(neigh, changed);
             if(interval > 0)
                 /* Multiply by 3/2 to allow hellos to expire. */
                 schedule_neighbours_check(interval * 15, 0);
             /* Sub-TLV handling. */
-            if(len > 8) {
-                if(parse_hello_subtlv(message + 8, len - 6, &timestamp) > 0) {
+            if(len > 6) {
+                if(parse_hello_subtlv(message + 8, len - 6, &timestamp,
+                                      &digest, &digest_len) > 0) {
                     neigh->hello_send_us = timestamp;
                     neigh->hello_rtt_receive_time = now;
                     have_hello_rtt = 1;
                 }
             }
+            /* A Hello with a digest sub-TLV, even one that only
+               carries the router-id, means that the neighbour understands
+               digests. */
+            if(digest_len >= DIGEST_HELLO_LEN) {
+                if(!neigh->digest || memcmp(neigh->digest_id, digest, 8) != 0)
+                    digest_changed();
+                neigh->digest = 1;
+                memcpy(neigh->digest_id, digest, 8);
+                if(digest_len == DIGEST_HELLO_LEN + DIGEST_NODE_LEN)
+                    digest_hello_received(neigh,
+                                          digest + DIGEST_HELLO_LEN);
+            } else {
+                if(neigh->digest)
+                    digest_changed();
+                neigh->digest = 0;
+            }
         } else if(type == MESSAGE_IHU) {
             unsigned short txcost, interval;
             unsigned char address[16];
+            const unsigned char *digest = NULL;
+            int digest_len = -1;
             int rc;
             if(len < 6) goto fail;
             DO_NTOHS(txcost, message + 4);
@@ -402,10 +505,16 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                 if(interval > 0)
                     /* Multiply by 3/2 to allow neighbours to expire. */
                     schedule_neighbours_check(interval * 45, 0);
-                /* RTT sub-TLV. */
+                /* RTT and digest sub-TLVs. */
                 if(len > 10 + rc)
                     parse_ihu_subtlv(message + 8 + rc, len - 6 - rc,
-                                     &hello_send_us, &hello_rtt_receive_time);
+                                     &hello_send_us, &hello_rtt_receive_time,
+                                     &digest, &digest_len);
+                if(digest_len == DIGEST_ACK_LEN && digest[0] == 1) {
+                    unsigned short mask;
+                    DO_NTOHS(mask, digest + 2);
+                    digest_ack_received(neigh, digest[1], mask);
+                }
             }
         } else if(type == MESSAGE_ROUTER_ID) {
             if(len < 10) {
@@ -456,10 +565,10 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             DO_NTOHS(seqno, message + 8);
             DO_NTOHS(metric, message + 10);
             if(message[5] == 0 ||
-               (message[2] == 1 ? have_v4_prefix : have_v6_prefix))
+               (ae_is_v4(message[2]) ? have_v4_prefix : have_v6_prefix))
                 rc = network_prefix(message[2], message[4], message[5],
                                     message + 12,
-                                    message[2] == 1 ? v4_prefix : v6_prefix,
+                                    ae_is_v4(message[2]) ? v4_prefix : v6_prefix,
                                     len - 10, prefix);
             else
                 rc = -1;
@@ -470,10 +579,10 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             }
             parsed_len = 10 + rc;
 
-            plen = message[4] + (message[2] == 1 ? 96 : 0);
+            plen = message[4] + (ae_is_v4(message[2]) ? 96 : 0);
 
             if(message[3] & 0x80) {
-                if(message[2] == 1) {
+                if(ae_is_v4(message[2])) {
                     memcpy(v4_prefix, prefix, 16);
                     have_v4_prefix = 1;
                 } else {
@@ -482,7 +591,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
                 }
             }
             if(message[3] & 0x40) {
-                if(message[2] == 1) {
+                if(ae_is_v4(message[2])) {
                     memset(router_id, 0, 4);
                     memcpy(router_id + 4, prefix + 12, 4);
                 } else {
@@ -521,6 +630,9 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             if(message[2] == 1) {
                 if(!ifp->ipv4)
                     goto done;
+            } else if(message[2] == 4) {
+                if(!has_v4viav6)
+                    goto done;
             }
 
             if((ifp->flags & IF_FARAWAY)) {
@@ -551,11 +663,33 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             rc = network_prefix(message[2], message[3], 0,
                                 message + 4, NULL, len - 2, prefix);
             if(rc < 0) goto fail;
-            plen = message[3] + (message[2] == 1 ? 96 : 0);
+            plen = message[3] + (ae_is_v4(message[2]) ? 96 : 0);
             debugf("Received request for %s from %s on %s.\n",
                    message[2] == 0 ? "any" : format_prefix(prefix, plen),
                    format_address(from), ifp->name);
             if(message[2] == 0) {
+                const unsigned char *digest = NULL, *range = NULL;
+                int digest_len = -1, range_len = -1;
+                if(len > 2 + rc)
+                    parse_request_subtlv(message + 4 + rc, len - 2 - rc,
+                                         &digest, &digest_len,
+                                         &range, &range_len);
+                if(digest_len == DIGEST_NODE_LEN &&
+                   (neigh->ifp->flags & IF_DIGEST)) {
+                    /* Only the leaves that differ are resent, and the
+                       IHU tells the neighbour which ones matched. */
+                    digest_request_received(neigh, digest);
+                    goto done;
+                }
+                if(range_len >= 2 && range[0] != 0 &&
+                   network_prefix(range[0], range[1], 0, range + 2, NULL,
+                                  range_len - 2, prefix) >= 0) {
+                    plen = range[1] + (ae_is_v4(range[0]) ? 96 : 0);
+                    debugf("Received request for any within %s.\n",
+                           format_prefix(prefix, plen));
+                    send_update_within(neigh->ifp, prefix, plen);
+                    goto done;
+                }
                 /* If a neighbour is requesting a full route dump from us,
                    we might as well send it an IHU. */
                 send_ihu(neigh, NULL);
@@ -578,7 +712,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             rc = network_prefix(message[2], message[3], 0,
                                 message + 16, NULL, len - 14, prefix);
             if(rc < 0) goto fail;
-            plen = message[3] + (message[2] == 1 ? 96 : 0);
+            plen = message[3] + (ae_is_v4(message[2]) ? 96 : 0);
             debugf("Received request (%d) for %s from %s on %s (%s, %d).\n",
                    message[6],
                    format_prefix(prefix, plen),
@@ -602,9 +736,9 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             DO_NTOHS(interval, message + 6);
             DO_NTOHS(seqno, message + 8);
             DO_NTOHS(metric, message + 10);
-            if(omitted == 0 || (ae == 1 ? have_v4_prefix : have_v6_prefix))
+            if(omitted == 0 || (ae_is_v4(ae) ? have_v4_prefix : have_v6_prefix))
                 rc = network_prefix(ae, plen, omitted, message + 12,
-                                    ae == 1 ? v4_prefix : v6_prefix,
+                                    ae_is_v4(ae) ? v4_prefix : v6_prefix,
                                     len - 10, prefix);
             else
                 rc = -1;
@@ -619,7 +753,7 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             if(rc < 0)
                 goto fail;
             parsed_len += rc;
-            if(ae == 1) {
+            if(ae_is_v4(ae)) {
                 plen += 96;
                 src_plen += 96;
             }
@@ -650,6 +784,9 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             if(ae == 1) {
                 if(!ifp->ipv4)
                     goto done;
+            } else if(ae == 4) {
+                if(!has_v4viav6)
+                    goto done;
             }
 
             if((ifp->flags & IF_FARAWAY)) {
@@ -683,13 +820,13 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             rc = network_prefix(ae, plen, 0, message + parsed,
                                 NULL, len + 2 - parsed, prefix);
             if(rc < 0) goto fail;
-            if(ae == 1)
+            if(ae_is_v4(ae))
                 plen += 96;
             parsed += rc;
             rc = network_prefix(ae, src_plen, 0, message + parsed,
                                 NULL, len + 2 - parsed, src_prefix);
             if(rc < 0) goto fail;
-            if(ae == 1)
+            if(ae_is_v4(ae))
                 src_plen += 96;
             parsed += rc;
             if(ae == 0) {
@@ -723,13 +860,13 @@ parse_packet(const unsigned char *from, struct interface *ifp,
             rc = network_prefix(ae, plen, 0, message + parsed,
                                 NULL, len + 2 - parsed, prefix);
             if(rc < 0) goto fail;
-            if(ae == 1)
+            if(ae_is_v4(ae))
                 plen += 96;
             parsed += rc;
             rc = network_prefix(ae, src_plen, 0, message + parsed,
                                 NULL, len + 2 - parsed, src_prefix);
             if(rc < 0) goto fail;
-            if(ae == 1)
+            if(ae_is_v4(ae))
                 src_plen += 96;
             debugf("Received request (%d) for (%s, %s)"
                    " from %s on %s (%s, %d).\n",
@@ -794,6 +931,171 @@ parse_packet(const unsigned char *from, struct interface *ifp,
     return;
 }
 
+static int
+count_messages(const unsigned char *packet, int packetlen)
+{
+    int i = 0, n = 0, bodylen;
+
+    DO_NTOHS(bodylen, packet + 2);
+    bodylen = MIN(bodylen, packetlen - 4);
+    while(i < bodylen) {
+        n++;
+        if(packet[4 + i] == MESSAGE_PAD1)
+            i++;
+        else if(i + 1 < bodylen)
+            i += packet[4 + i + 1] + 2;
+        else
+            break;
+    }
+    return n;
+}
+
+static void
+refill_receive_tokens(struct neighbour *neigh)
+{
+    long long tokens;
+    int max = receive_rate * 4;
+
+    tokens = (long long)timeval_minus_msec(&now, &neigh->receive_time) *
+        receive_rate / 1000;
+    if(tokens > 0) {
+        neigh->receive_tokens = MIN(neigh->receive_tokens + tokens, max);
+        neigh->receive_time = now;
+    }
+}
+
+static void
+defer_packet(struct neighbour *neigh,
+             const unsigned char *packet, int packetlen)
+{
+    struct deferred_packet *p;
+
+    /* The Hello and IHU in the oldest packet have already been handled. */
+    if(neigh->backlog_len >= MAX_RECEIVE_BACKLOG) {
+        p = neigh->backlog;
+        neigh->backlog = p->next;
+        neigh->backlog_len--;
+        neigh->dropped++;
+        free(p->packet);
+        free(p);
+        if(neigh->backlog == NULL)
+            neigh->backlog_tail = NULL;
+    }
+
+    p = malloc(sizeof(struct deferred_packet));
+    if(p == NULL) {
+        perror("malloc(deferred_packet)");
+        neigh->dropped++;
+        return;
+    }
+    p->packet = malloc(packetlen);
+    if(p->packet == NULL) {
+        perror("malloc(deferred_packet)");
+        free(p);
+        neigh->dropped++;
+        return;
+    }
+    memcpy(p->packet, packet, packetlen);
+    p->len = packetlen;
+    p->next = NULL;
+    if(neigh->backlog_tail)
+        neigh->backlog_tail->next = p;
+    else
+        neigh->backlog = p;
+    neigh->backlog_tail = p;
+    neigh->backlog_len++;
+    neigh->deferred++;
+    if(receive_backlog_time.tv_sec == 0)
+        receive_backlog_time = now;
+}
+
+void
+receive_packet(const unsigned char *from, struct interface *ifp,
+               const unsigned char *packet, int packetlen)
+{
+    struct neighbour *neigh;
+
+    if(receive_rate <= 0 || packetlen < 4 ||
+       packet[0] != 42 || packet[1] != 2 || !linklocal(from)) {
+        parse_packet(from, ifp, packet, packetlen, PARSE_ALL);
+        return;
+    }
+
+    neigh = find_neighbour(from, ifp);
+    if(neigh == NULL) {
+        fprintf(stderr, "Couldn't allocate neighbour.\n");
+        return;
+    }
+
+    refill_receive_tokens(neigh);
+    /* A large packet may take us into debt, which avoids having to split
+       it. */
+    if(neigh->backlog == NULL && neigh->receive_tokens > 0) {
+        neigh->receive_tokens -= count_messages(packet, packetlen);
+        parse_packet(from, ifp, packet, packetlen, PARSE_ALL);
+        return;
+    }
+
+    /* Over the limit.  Link sensing must not suffer, so Hellos and IHUs
+       are handled now, and the rest of the packet later. */
+    parse_packet(from, ifp, packet, packetlen, PARSE_LINK);
+    defer_packet(neigh, packet, packetlen);
+}
+
+/* Handle one deferred packet from every backlogged neighbour that has
+   tokens, and schedule the next round. */
+void
+process_receive_backlog()
+{
+    struct neighbour *neigh;
+    struct deferred_packet *p;
+    struct timeval next = {0, 0}, t;
+    unsigned msecs;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->backlog == NULL)
+            continue;
+        refill_receive_tokens(neigh);
+        if(neigh->receive_tokens > 0) {
+            p = neigh->backlog;
+            neigh->backlog = p->next;
+            if(neigh->backlog == NULL)
+                neigh->backlog_tail = NULL;
+            neigh->backlog_len--;
+            neigh->receive_tokens -= count_messages(p->packet, p->len);
+            parse_packet(neigh->address, neigh->ifp, p->packet, p->len,
+                         PARSE_OTHER);
+            free(p->packet);
+            free(p);
+        }
+        if(neigh->backlog == NULL)
+            continue;
+        if(neigh->receive_tokens > 0)
+            t = now;
+        else {
+            msecs = (1 - neigh->receive_tokens) * 1000LL / receive_rate;
+            timeval_add_msec(&t, &neigh->receive_time, msecs + 1);
+        }
+        timeval_min(&next, &t);
+    }
+    receive_backlog_time = next;
+}
+
+void
+flush_receive_backlog(struct neighbour *neigh)
+{
+    struct deferred_packet *p;
+
+    while(neigh->backlog) {
+        p = neigh->backlog;
+        neigh->backlog = p->next;
+        free(p->packet);
+        free(p);
+    }
+    neigh->backlog_tail = NULL;
+    neigh->backlog_len = 0;
+}
+
 /* Under normal circumstances, there are enough moderation mechanisms
    elsewhere in the protocol to make sure that this last-ditch check
    should never trigger.  But I'm superstitious. */
@@ -842,11 +1144,133 @@ fill_rtt_message(struct interface *ifp)
     return 0;
 }
 
+/* Average the bytes flushed over windows of at least a second. */
+static void
+update_send_rate(struct interface *ifp)
+{
+    unsigned msecs = timeval_minus_msec(&now, &ifp->rate_time);
+
+    if(msecs < 1000)
+        return;
+    ifp->send_rate = (ifp->send_rate +
+                      (unsigned long long)ifp->rate_bytes * 1000 / msecs) / 2;
+    ifp->rate_bytes = 0;
+    ifp->rate_time = now;
+}
+
+static int
+send_packet(struct interface *ifp, const unsigned char *address,
+            const unsigned char *buf, int buflen)
+{
+    struct sockaddr_in6 sin6;
+
+    memset(&sin6, 0, sizeof(sin6));
+    sin6.sin6_family = AF_INET6;
+    memcpy(&sin6.sin6_addr, address, 16);
+    sin6.sin6_port = htons(protocol_port);
+    sin6.sin6_scope_id = ifp->ifindex;
+    DO_HTONS(packet_header + 2, buflen);
+    if(address == protocol_group)
+        ifp->multicast_bytes += sizeof(packet_header) + buflen;
+    else
+        ifp->unicast_bytes += sizeof(packet_header) + buflen;
+    return babel_send(protocol_socket,
+                      packet_header, sizeof(packet_header),
+                      buf, buflen,
+                      (struct sockaddr*)&sin6, sizeof(sin6));
+}
+
+/* Whether the buffer of a unicast interface is sent to every neighbour
+   in turn, in which case its Hellos are Unicast Hellos. */
+static int
+unicast_interface(struct interface *ifp)
+{
+    struct neighbour *neigh;
+
+    if(!(ifp->flags & IF_UNICAST))
+        return 0;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp == ifp)
+            return 1;
+    }
+    return 0;
+}
+
+/* A buffered Multicast Hello must be multicast even if a neighbour has
+   appeared since it was buffered. */
+static int
+multicast_buffer(struct interface *ifp)
+{
+    if(ifp->buffered_hello >= 0 &&
+       !(ifp->sendbuf[ifp->buffered_hello + 2] & (HELLO_FLAG_UNICAST >> 8)))
+        return 1;
+    return !unicast_interface(ifp);
+}
+
+/* On unicast interfaces, a Multicast Hello is sent on its own once every
+   UNICAST_DISCOVERY_HELLOS Unicast Hellos, with an interval to match. */
+static void
+send_multicast_hello(struct interface *ifp, unsigned interval)
+{
+    unsigned char buf[8 + 2 + DIGEST_HELLO_LEN];
+    int len = 8, rc;
+
+    ifp->hello_seqno = seqno_plus(ifp->hello_seqno, 1);
+
+    debugf("Sending multicast hello %d (%d) to %s.\n",
+           ifp->hello_seqno, interval, ifp->name);
+
+    buf[0] = MESSAGE_HELLO;
+    DO_HTONS(buf + 2, 0);
+    DO_HTONS(buf + 4, ifp->hello_seqno);
+    DO_HTONS(buf + 6, interval > 0xFFFF ? 0xFFFF : interval);
+    /* Without the digest sub-TLV, neighbours would assume that we don't
+       understand digests. */
+    if(ifp->flags & IF_DIGEST) {
+        buf[len++] = SUBTLV_DIGEST;
+        buf[len++] = DIGEST_HELLO_LEN;
+        memcpy(buf + len, myid, 8);
+        len += 8;
+    }
+    buf[1] = len - 2;
+
+    if(!check_bucket(ifp)) {
+        fprintf(stderr, "Warning: bucket full, dropping hello to %s.\n",
+                ifp->name);
+        return;
+    }
+    rc = send_packet(ifp, protocol_group, buf, len);
+    if(rc < 0)
+        perror("send");
+}
+
+/* Bump the seqno of the next Hello, which is a Unicast Hello if unicast
+   is true, and return it.  interval is the one the Hello announces. */
+static unsigned short
+next_hello_seqno(struct interface *ifp, int unicast, unsigned interval)
+{
+    if(!unicast) {
+        ifp->hello_seqno = seqno_plus(ifp->hello_seqno, 1);
+        return ifp->hello_seqno;
+    }
+    ifp->unicast_hello_seqno = seqno_plus(ifp->unicast_hello_seqno, 1);
+    if(!if_up(ifp))
+        return ifp->unicast_hello_seqno;
+    /* When shutting down, our neighbours must forget both kinds of
+       Hellos quickly. */
+    if(interval < (ifp->hello_interval + 9) / 10)
+        send_multicast_hello(ifp, interval);
+    else if(ifp->unicast_hello_seqno % UNICAST_DISCOVERY_HELLOS == 0)
+        send_multicast_hello(ifp, interval * UNICAST_DISCOVERY_HELLOS);
+    return ifp->unicast_hello_seqno;
+}
+
 void
 flushbuf(struct interface *ifp)
 {
     int rc;
-    struct sockaddr_in6 sin6;
+    struct neighbour *neigh;
 
     assert(ifp->buffered <= ifp->bufsize);
 
@@ -856,23 +1280,31 @@ flushbuf(struct interface *ifp)
         debugf("  (flushing %d buffered bytes on %s)\n",
                ifp->buffered, ifp->name);
         if(check_bucket(ifp)) {
-            memset(&sin6, 0, sizeof(sin6));
-            sin6.sin6_family = AF_INET6;
-            memcpy(&sin6.sin6_addr, protocol_group, 16);
-            sin6.sin6_port = htons(protocol_port);
-            sin6.sin6_scope_id = ifp->ifindex;
-            DO_HTONS(packet_header + 2, ifp->buffered);
             fill_rtt_message(ifp);
-            rc = babel_send(protocol_socket,
-                            packet_header, sizeof(packet_header),
-                            ifp->sendbuf, ifp->buffered,
-                            (struct sockaddr*)&sin6, sizeof(sin6));
-            if(rc < 0)
-                perror("send");
+            if(multicast_buffer(ifp)) {
+                rc = send_packet(ifp, protocol_group,
+                                 ifp->sendbuf, ifp->buffered);
+                if(rc < 0)
+                    perror("send");
+            } else {
+                FOR_ALL_NEIGHBOURS(neigh) {
+                    if(neigh->ifp != ifp)
+                        continue;
+                    rc = send_packet(ifp, neigh->address,
+                                     ifp->sendbuf, ifp->buffered);
+                    if(rc < 0)
+                        perror("send(unicast)");
+                }
+            }
         } else {
             fprintf(stderr, "Warning: bucket full, dropping packet to %s.\n",
                     ifp->name);
         }
+        ifp->flushed_packets++;
+        ifp->fill_total += ifp->buffered * 1000 / ifp->bufsize;
+        ifp->delay_total += timeval_minus_msec(&now, &ifp->buffered_time);
+        ifp->rate_bytes += ifp->buffered;
+        update_send_rate(ifp);
     }
     VALGRIND_MAKE_MEM_UNDEFINED(ifp->sendbuf, ifp->bufsize);
     ifp->buffered = 0;
@@ -882,23 +1314,38 @@ flushbuf(struct interface *ifp)
     ifp->have_buffered_prefix = 0;
     ifp->flush_timeout.tv_sec = 0;
     ifp->flush_timeout.tv_usec = 0;
+    ifp->flush_urgent = 0;
 }
 
 static void
-schedule_flush(struct interface *ifp)
+schedule_flush_now(struct interface *ifp)
 {
-    unsigned msecs = jitter(ifp, 0);
+    /* Almost now */
+    unsigned msecs = roughly(10);
     if(ifp->flush_timeout.tv_sec != 0 &&
        timeval_minus_msec(&ifp->flush_timeout, &now) < msecs)
         return;
     set_timeout(&ifp->flush_timeout, msecs);
 }
 
+/* Hold the buffer for less time the fuller it is, and only briefly if
+   little traffic is expected to join it before it is sent. */
 static void
-schedule_flush_now(struct interface *ifp)
+schedule_flush(struct interface *ifp)
 {
-    /* Almost now */
-    unsigned msecs = roughly(10);
+    unsigned msecs, space;
+
+    space = ifp->bufsize - ifp->buffered;
+    if(space < FLUSH_FULL_SPACE) {
+        schedule_flush_now(ifp);
+        return;
+    }
+
+    update_send_rate(ifp);
+    msecs = jitter(ifp, 0) * (unsigned long long)space / ifp->bufsize;
+    if((unsigned long long)ifp->send_rate * msecs / 1000 < FLUSH_FULL_SPACE)
+        msecs = MIN(msecs, FLUSH_IDLE_DELAY);
+
     if(ifp->flush_timeout.tv_sec != 0 &&
        timeval_minus_msec(&ifp->flush_timeout, &now) < msecs)
         return;
@@ -930,6 +1377,8 @@ start_message(struct interface *ifp, int type, int len)
 {
     if(ifp->bufsize - ifp->buffered < len + 2)
         flushbuf(ifp);
+    if(ifp->buffered == 0)
+        ifp->buffered_time = now;
     ifp->sendbuf[ifp->buffered++] = type;
     ifp->sendbuf[ifp->buffered++] = len;
 }
@@ -1047,24 +1496,49 @@ send_ack(struct neighbour *neigh, unsigned short nonce, unsigned short interval)
 void
 send_hello_noupdate(struct interface *ifp, unsigned interval)
 {
+    unsigned int digests[DIGEST_FANOUT];
+    int digest_len = -1;
+    int msglen, i, unicast;
+    unsigned short seqno;
+
     /* This avoids sending multiple hellos in a single packet, which breaks
        link quality estimation. */
     if(ifp->buffered_hello >= 0)
         flushbuf(ifp);
 
-    ifp->hello_seqno = seqno_plus(ifp->hello_seqno, 1);
+    unicast = unicast_interface(ifp);
+    seqno = next_hello_seqno(ifp, unicast, interval);
     set_timeout(&ifp->hello_timeout, ifp->hello_interval);
 
     if(!if_up(ifp))
         return;
 
-    debugf("Sending hello %d (%d) to %s.\n",
-           ifp->hello_seqno, interval, ifp->name);
+    debugf("Sending %shello %d (%d) to %s.\n",
+           unicast ? "unicast " : "", seqno, interval, ifp->name);
+
+    if(ifp->flags & IF_DIGEST) {
+        /* A digest sub-TLV with just our router-id advertises that we
+           understand them. */
+        digest_len = DIGEST_HELLO_LEN;
+        if(ifp->digest_pending) {
+            ifp->digest_pending = 0;
+            /* A neighbour may have appeared since the periodic update
+               was replaced by a digest. */
+            if(digest_capable(ifp) && digest_root(ifp, digests) >= 0)
+                digest_len = DIGEST_HELLO_LEN + DIGEST_NODE_LEN;
+            else
+                send_update(ifp, 0, NULL, 0, NULL, 0);
+        }
+    }
+
+    msglen = (ifp->flags & IF_TIMESTAMPS) ? 12 : 6;
+    if(digest_len >= 0)
+        msglen += 2 + digest_len;
 
-    start_message(ifp, MESSAGE_HELLO, (ifp->flags & IF_TIMESTAMPS) ? 12 : 6);
+    start_message(ifp, MESSAGE_HELLO, msglen);
     ifp->buffered_hello = ifp->buffered - 2;
-    accumulate_short(ifp, 0);
-    accumulate_short(ifp, ifp->hello_seqno);
+    accumulate_short(ifp, unicast ? HELLO_FLAG_UNICAST : 0);
+    accumulate_short(ifp, seqno);
     accumulate_short(ifp, interval > 0xFFFF ? 0xFFFF : interval);
     if(ifp->flags & IF_TIMESTAMPS) {
         /* Sub-TLV containing the local time of emission. We use a
@@ -1073,24 +1547,226 @@ send_hello_noupdate(struct interface *ifp, unsigned interval)
         accumulate_byte(ifp, 4);
         accumulate_int(ifp, 0);
     }
-    end_message(ifp, MESSAGE_HELLO, (ifp->flags & IF_TIMESTAMPS) ? 12 : 6);
+    if(digest_len >= 0) {
+        accumulate_byte(ifp, SUBTLV_DIGEST);
+        accumulate_byte(ifp, digest_len);
+        accumulate_bytes(ifp, myid, 8);
+        if(digest_len > DIGEST_HELLO_LEN) {
+            accumulate_byte(ifp, 0);
+            accumulate_byte(ifp, 0);
+            for(i = 0; i < DIGEST_FANOUT; i++)
+                accumulate_int(ifp, digests[i]);
+        }
+    }
+    end_message(ifp, MESSAGE_HELLO, msglen);
+}
+
+/* The Hello, followed by an IHU for every neighbour on the interface,
+   is kept prebuilt in ifp->hello_template.  Sending them only requires
+   patching the seqno, the rxcosts and the timestamps, and copying the
+   result into the send buffer.  The template is dropped whenever the
+   neighbours or the parameters of the interface change.
+
+   On interfaces with timestamps, every IHU has room for a timestamp
+   sub-TLV, which is padding when we have no RTT data for the
+   neighbour. */
+static int
+build_hello_template(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    unsigned char *buf;
+    unsigned interval;
+    int size, len, msglen, ll;
+
+    size = 2 + 6 + 6 + 2 + DIGEST_HELLO_LEN;
+    if(!(ifp->flags & IF_UNICAST)) {
+        FOR_ALL_NEIGHBOURS(neigh) {
+            if(neigh->ifp == ifp)
+                size += 2 + 22 + 10;
+        }
+    }
+
+    if(size > ifp->hello_template_size) {
+        buf = realloc(ifp->hello_template, size);
+        if(buf == NULL) {
+            perror("realloc(hello_template)");
+            return -1;
+        }
+        ifp->hello_template = buf;
+        ifp->hello_template_size = size;
+    }
+    buf = ifp->hello_template;
+
+    interval = (ifp->hello_interval + 9) / 10;
+    msglen = (ifp->flags & IF_TIMESTAMPS) ? 12 : 6;
+    if(ifp->flags & IF_DIGEST)
+        msglen += 2 + DIGEST_HELLO_LEN;
+    buf[0] = MESSAGE_HELLO;
+    buf[1] = msglen;
+    DO_HTONS(buf + 2, 0);
+    DO_HTONS(buf + 4, 0);
+    DO_HTONS(buf + 6, interval > 0xFFFF ? 0xFFFF : interval);
+    len = 8;
+    if(ifp->flags & IF_TIMESTAMPS) {
+        /* Filled by fill_rtt_message, see send_hello_noupdate. */
+        buf[len++] = SUBTLV_PADN;
+        buf[len++] = 4;
+        DO_HTONL(buf + len, 0);
+        len += 4;
+    }
+    if(ifp->flags & IF_DIGEST) {
+        buf[len++] = SUBTLV_DIGEST;
+        buf[len++] = DIGEST_HELLO_LEN;
+        memcpy(buf + len, myid, 8);
+        len += 8;
+    }
+    ifp->hello_template_hello = len;
+
+    if(!(ifp->flags & IF_UNICAST)) {
+        interval = (ifp->hello_interval * 3 + 9) / 10;
+        FOR_ALL_NEIGHBOURS(neigh) {
+            if(neigh->ifp != ifp)
+                continue;
+            ll = linklocal(neigh->address);
+            msglen = (ll ? 14 : 22) + ((ifp->flags & IF_TIMESTAMPS) ? 10 : 0);
+            buf[len] = MESSAGE_IHU;
+            buf[len + 1] = msglen;
+            buf[len + 2] = ll ? 3 : 2;
+            buf[len + 3] = 0;
+            DO_HTONS(buf + len + 4, INFINITY);
+            DO_HTONS(buf + len + 6, interval);
+            if(ll)
+                memcpy(buf + len + 8, neigh->address + 8, 8);
+            else
+                memcpy(buf + len + 8, neigh->address, 16);
+            if(ifp->flags & IF_TIMESTAMPS) {
+                buf[len + msglen - 8] = SUBTLV_PADN;
+                buf[len + msglen - 7] = 8;
+                memset(buf + len + msglen - 6, 0, 8);
+            }
+            len += 2 + msglen;
+        }
+    }
+
+    assert(len <= size);
+    ifp->hello_template_len = len;
+    return 1;
+}
+
+static void
+patch_ihu_template(struct interface *ifp)
+{
+    struct neighbour *neigh;
+    unsigned char *buf = ifp->hello_template, *ts;
+    int rxcost, i = ifp->hello_template_hello;
+
+    FOR_ALL_NEIGHBOURS(neigh) {
+        if(neigh->ifp != ifp)
+            continue;
+        assert(i < ifp->hello_template_len && buf[i] == MESSAGE_IHU);
+        rxcost = neighbour_rxcost(neigh);
+        debugf("Sending ihu %d on %s to %s.\n",
+               rxcost, ifp->name, format_address(neigh->address));
+        DO_HTONS(buf + i + 4, rxcost);
+        if(ifp->flags & IF_TIMESTAMPS) {
+            ts = buf + i + 2 + buf[i + 1] - 10;
+            if(neigh->hello_send_us &&
+               timeval_minus_msec(&now, &neigh->hello_rtt_receive_time) <
+               1000000) {
+                ts[0] = SUBTLV_TIMESTAMP;
+                DO_HTONL(ts + 2, neigh->hello_send_us);
+                DO_HTONL(ts + 6, time_us(neigh->hello_rtt_receive_time));
+            } else {
+                neigh->hello_send_us = 0;
+                ts[0] = SUBTLV_PADN;
+                memset(ts + 2, 0, 8);
+            }
+        }
+        i += 2 + buf[i + 1];
+    }
+    assert(i == ifp->hello_template_len);
+}
+
+/* Copy the first len bytes of the template, as few packets as possible. */
+static void
+send_hello_template(struct interface *ifp, int len)
+{
+    const unsigned char *buf = ifp->hello_template;
+    int i = 0, n;
+
+    while(i < len) {
+        n = 0;
+        while(i + n < len &&
+              ifp->buffered + n + 2 + buf[i + n + 1] <= ifp->bufsize)
+            n += 2 + buf[i + n + 1];
+        if(n == 0) {
+            if(ifp->buffered == 0) {
+                fprintf(stderr, "Message too large for %s.\n", ifp->name);
+                break;
+            }
+            flushbuf(ifp);
+            continue;
+        }
+        if(ifp->buffered == 0)
+            ifp->buffered_time = now;
+        if(i == 0)
+            ifp->buffered_hello = ifp->buffered;
+        memcpy(ifp->sendbuf + ifp->buffered, buf + i, n);
+        ifp->buffered += n;
+        i += n;
+    }
+    schedule_flush(ifp);
 }
 
 void
 send_hello(struct interface *ifp)
 {
-    send_hello_noupdate(ifp, (ifp->hello_interval + 9) / 10);
-    /* Send full IHU every 3 hellos, and marginal IHU each time */
-    if(ifp->hello_seqno % 3 == 0)
-        send_ihu(NULL, ifp);
-    else
-        send_marginal_ihu(ifp);
+    int full, unicast;
+    unsigned short seqno;
+
+    /* A Hello carrying a digest is built by hand. */
+    if(!if_up(ifp) || ((ifp->flags & IF_DIGEST) && ifp->digest_pending) ||
+       (ifp->hello_template_len == 0 && build_hello_template(ifp) < 0)) {
+        send_hello_noupdate(ifp, (ifp->hello_interval + 9) / 10);
+        seqno = unicast_interface(ifp) ?
+            ifp->unicast_hello_seqno : ifp->hello_seqno;
+        /* Send full IHU every 3 hellos, and marginal IHU each time */
+        if(seqno % 3 == 0)
+            send_ihu(NULL, ifp);
+        else
+            send_marginal_ihu(ifp);
+        return;
+    }
+
+    /* See send_hello_noupdate. */
+    if(ifp->buffered_hello >= 0)
+        flushbuf(ifp);
+
+    unicast = unicast_interface(ifp);
+    seqno = next_hello_seqno(ifp, unicast, (ifp->hello_interval + 9) / 10);
+    set_timeout(&ifp->hello_timeout, ifp->hello_interval);
+
+    debugf("Sending %shello %d (%d) to %s.\n", unicast ? "unicast " : "",
+           seqno, (ifp->hello_interval + 9) / 10, ifp->name);
+
+    DO_HTONS(ifp->hello_template + 2, unicast ? HELLO_FLAG_UNICAST : 0);
+    DO_HTONS(ifp->hello_template + 4, seqno);
+    full = seqno % 3 == 0;
+    if(full && !(ifp->flags & IF_UNICAST)) {
+        patch_ihu_template(ifp);
+        send_hello_template(ifp, ifp->hello_template_len);
+    } else {
+        send_hello_template(ifp, ifp->hello_template_hello);
+        if(full)
+            send_ihu(NULL, ifp);
+        else
+            send_marginal_ihu(ifp);
+    }
 }
 
 void
 flush_unicast(int dofree)
 {
-    struct sockaddr_in6 sin6;
     int rc;
 
     if(unicast_buffered == 0)
@@ -1103,17 +1779,9 @@ flush_unicast(int dofree)
     flushbuf(unicast_neighbour->ifp);
 
     if(check_bucket(unicast_neighbour->ifp)) {
-        memset(&sin6, 0, sizeof(sin6));
-        sin6.sin6_family = AF_INET6;
-        memcpy(&sin6.sin6_addr, unicast_neighbour->address, 16);
-        sin6.sin6_port = htons(protocol_port);
-        sin6.sin6_scope_id = unicast_neighbour->ifp->ifindex;
-        DO_HTONS(packet_header + 2, unicast_buffered);
         fill_rtt_message(unicast_neighbour->ifp);
-        rc = babel_send(protocol_socket,
-                        packet_header, sizeof(packet_header),
-                        unicast_buffer, unicast_buffered,
-                        (struct sockaddr*)&sin6, sizeof(sin6));
+        rc = send_packet(unicast_neighbour->ifp, unicast_neighbour->address,
+                         unicast_buffer, unicast_buffered);
         if(rc < 0)
             perror("send(unicast)");
     } else {
@@ -1136,7 +1804,7 @@ flush_unicast(int dofree)
     unicast_flush_timeout.tv_usec = 0;
 }
 
-static void
+void
 really_send_update(struct interface *ifp,
                    const unsigned char *id,
                    const unsigned char *prefix, unsigned char plen,
@@ -1144,7 +1812,7 @@ really_send_update(struct interface *ifp,
                    unsigned short seqno, unsigned short metric,
                    unsigned char *channels, int channels_len)
 {
-    int add_metric, v4, real_plen, omit = 0;
+    int add_metric, v4, via = 0, real_plen, omit = 0;
     const unsigned char *real_prefix;
     const unsigned char *real_src_prefix = NULL;
     int real_src_plen = 0;
@@ -1171,10 +1839,14 @@ really_send_update(struct interface *ifp,
     v4 = plen >= 96 && v4mapped(prefix);
 
     if(v4) {
-        if(!ifp->ipv4)
+        /* With AE 4, the next hop is our link-local address, as for IPv6,
+           and no NH TLV is needed. */
+        via = IF_CONF(ifp, v4viav6) == CONFIG_YES ||
+            (IF_CONF(ifp, v4viav6) == CONFIG_DEFAULT && !ifp->ipv4);
+        if(!via && !ifp->ipv4)
             return;
-        if(!ifp->have_buffered_nh ||
-           memcmp(ifp->buffered_nh, ifp->ipv4, 4) != 0) {
+        if(!via && (!ifp->have_buffered_nh ||
+                    memcmp(ifp->buffered_nh, ifp->ipv4, 4) != 0)) {
             start_message(ifp, MESSAGE_NH, 6);
             accumulate_byte(ifp, 1);
             accumulate_byte(ifp, 0);
@@ -1225,7 +1897,7 @@ really_send_update(struct interface *ifp,
         start_message(ifp, MESSAGE_UPDATE_SRC_SPECIFIC,
                       10 + (real_plen + 7) / 8 - omit +
                       (real_src_plen + 7) / 8 + channels_size);
-    accumulate_byte(ifp, v4 ? 1 : 2);
+    accumulate_byte(ifp, via ? 4 : v4 ? 1 : 2);
     if(src_plen != 0)
         accumulate_byte(ifp, real_src_plen);
     else
@@ -1256,6 +1928,12 @@ really_send_update(struct interface *ifp,
         memcpy(ifp->buffered_prefix, prefix, 16);
         ifp->have_buffered_prefix = 1;
     }
+
+    /* Retractions are urgent. */
+    if(metric >= INFINITY) {
+        ifp->flush_urgent = 1;
+        schedule_flush_now(ifp);
+    }
 }
 
 static int
@@ -1301,6 +1979,29 @@ compare_buffered_updates(const void *av, const void *bv)
     return memcmp(a->src_prefix, b->src_prefix, 16);
 }
 
+/* Announce a summary.  Announcing a larger metric than before with the
+   same seqno would make the summary unfeasible downstream, so we bump
+   our seqno in that case. */
+static void
+send_summary(struct interface *ifp, struct filter *f)
+{
+    int metric = summary_metric(f, ifp);
+
+    if(metric < INFINITY) {
+        if(f->summary_seqno == myseqno && metric > f->summary_metric)
+            update_myseqno();
+        if(f->summary_seqno != myseqno || metric < f->summary_metric) {
+            f->summary_seqno = myseqno;
+            f->summary_metric = metric;
+        }
+    }
+
+    debugf("Sending summary %s (%d) on %s.\n",
+           format_prefix(f->prefix, f->plen), metric, ifp->name);
+    really_send_update(ifp, myid, f->prefix, f->plen, zeroes, 0,
+                       myseqno, metric, NULL, 0);
+}
+
 void
 flushupdates(struct interface *ifp)
 {
@@ -1310,7 +2011,9 @@ flushupdates(struct interface *ifp)
     const unsigned char *last_src_prefix = NULL;
     unsigned char last_plen = 0xFF;
     unsigned char last_src_plen = 0xFF;
-    int i;
+    struct filter *summaries[MAX_SUMMARIES], *summary;
+    int numsummaries = 0;
+    int i, j;
 
     if(ifp == NULL) {
         struct interface *ifp_aux;
@@ -1359,6 +2062,24 @@ flushupdates(struct interface *ifp)
                memcmp(b[i].src_prefix, last_src_prefix, 16) == 0)
                 continue;
 
+            /* Routes covered by a summary are not announced individually,
+               a change to any of them causes the summary to be resent. */
+            summary = summary_filter(b[i].id, b[i].prefix, b[i].plen,
+                                     b[i].src_prefix, b[i].src_plen,
+                                     ifp->ifindex);
+            if(summary) {
+                for(j = 0; j < numsummaries; j++)
+                    if(summaries[j] == summary)
+                        break;
+                if(j < numsummaries)
+                    continue;
+                if(numsummaries < MAX_SUMMARIES)
+                    summaries[numsummaries++] = summary;
+                else
+                    send_summary(ifp, summary);
+                continue;
+            }
+
             xroute = find_xroute(b[i].prefix, b[i].plen,
                                  b[i].src_prefix, b[i].src_plen);
             route = find_installed_route(b[i].prefix, b[i].plen,
@@ -1429,6 +2150,8 @@ flushupdates(struct interface *ifp)
                                    myseqno, INFINITY, NULL, -1);
             }
         }
+        for(j = 0; j < numsummaries; j++)
+            send_summary(ifp, summaries[j]);
         schedule_flush_now(ifp);
     done:
         free(b);
@@ -1442,6 +2165,8 @@ schedule_update_flush(struct interface *ifp, int urgent)
 {
     unsigned msecs;
     msecs = update_jitter(ifp, urgent);
+    if(urgent)
+        ifp->flush_urgent = 1;
     if(ifp->update_flush_timeout.tv_sec != 0 &&
        timeval_minus_msec(&ifp->update_flush_timeout, &now) < msecs)
         return;
@@ -1565,6 +2290,54 @@ send_update_resend(struct interface *ifp,
                   0, NULL, NULL, resend_delay);
 }
 
+/* Answers a wildcard request restricted to a prefix range: only the
+   non-specific routes within prefix/plen are sent. */
+void
+send_update_within(struct interface *ifp,
+                   const unsigned char *prefix, unsigned char plen)
+{
+    struct xroute_stream *xroutes;
+    struct route_stream *routes;
+
+    if(!if_up(ifp))
+        return;
+
+    debugf("Sending update to %s for any within %s.\n",
+           ifp->name, format_prefix(prefix, plen));
+
+    /* There are few xroutes and they are not sorted, scan them all. */
+    xroutes = xroute_stream();
+    if(xroutes) {
+        while(1) {
+            struct xroute *xroute = xroute_stream_next(xroutes);
+            if(xroute == NULL) break;
+            if(xroute->src_plen != 0 || xroute->plen < plen ||
+               !in_prefix(xroute->prefix, prefix, plen))
+                continue;
+            buffer_update(ifp, xroute->prefix, xroute->plen,
+                          xroute->src_prefix, xroute->src_plen);
+        }
+        xroute_stream_done(xroutes);
+    } else {
+        fprintf(stderr, "Couldn't allocate xroute stream.\n");
+    }
+
+    routes = route_stream_within(prefix, plen);
+    if(routes) {
+        while(1) {
+            struct babel_route *route = route_stream_next(routes);
+            if(route == NULL)
+                break;
+            buffer_update(ifp, route->src->prefix, route->src->plen,
+                          route->src->src_prefix, route->src->src_plen);
+        }
+        route_stream_done(routes);
+    } else {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+    }
+    schedule_update_flush(ifp, 0);
+}
+
 void
 send_wildcard_retraction(struct interface *ifp)
 {
@@ -1587,6 +2360,8 @@ send_wildcard_retraction(struct interface *ifp)
     accumulate_short(ifp, myseqno);
     accumulate_short(ifp, 0xFFFF);
     end_message(ifp, MESSAGE_UPDATE, 10);
+    ifp->flush_urgent = 1;
+    schedule_flush_now(ifp);
 
     ifp->have_buffered_id = 0;
 }
@@ -1596,6 +2371,7 @@ update_myseqno()
 {
     myseqno = seqno_plus(myseqno, 1);
     seqno_time = now;
+    digest_changed();
 }
 
 void
@@ -1633,7 +2409,7 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
     int rxcost, interval;
     int ll;
     int send_rtt_data;
-    int msglen;
+    int msglen, unicast;
 
     if(neigh == NULL && ifp == NULL) {
         struct interface *ifp_aux;
@@ -1667,9 +2443,12 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
     /* Conceptually, an IHU is a unicast message.  We usually send them as
        multicast, since this allows aggregation into a single packet and
        avoids an ARP exchange.  If we already have a unicast message queued
-       for this neighbour, however, we might as well piggyback the IHU. */
+       for this neighbour, however, we might as well piggyback the IHU.  On
+       unicast interfaces, there is nothing to aggregate with. */
+    unicast = unicast_neighbour == neigh || (ifp->flags & IF_UNICAST);
+
     debugf("Sending %sihu %d on %s to %s.\n",
-           unicast_neighbour == neigh ? "unicast " : "",
+           unicast ? "unicast " : "",
            rxcost,
            neigh->ifp->name,
            format_address(neigh->address));
@@ -1689,7 +2468,7 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
        optional 10-bytes sub-TLV for timestamps (used to compute a RTT). */
     msglen = (ll ? 14 : 22) + (send_rtt_data ? 10 : 0);
 
-    if(unicast_neighbour != neigh) {
+    if(!unicast) {
         start_message(ifp, MESSAGE_IHU, msglen);
         accumulate_byte(ifp, ll ? 3 : 2);
         accumulate_byte(ifp, 0);
@@ -1729,6 +2508,40 @@ send_ihu(struct neighbour *neigh, struct interface *ifp)
     }
 }
 
+/* Acknowledge the leaves of a bucket whose digests matched.  This is
+   a unicast IHU, which the neighbour was going to get anyway. */
+void
+send_digest_ack(struct neighbour *neigh, int bucket, unsigned short mask)
+{
+    int rc, ll, msglen;
+
+    if(!if_up(neigh->ifp))
+        return;
+
+    debugf("Sending digest ack %04x for bucket %d to %s.\n",
+           mask, bucket, format_address(neigh->address));
+
+    ll = linklocal(neigh->address);
+    msglen = (ll ? 14 : 22) + 2 + DIGEST_ACK_LEN;
+
+    rc = start_unicast_message(neigh, MESSAGE_IHU, msglen);
+    if(rc < 0) return;
+    accumulate_unicast_byte(neigh, ll ? 3 : 2);
+    accumulate_unicast_byte(neigh, 0);
+    accumulate_unicast_short(neigh, neighbour_rxcost(neigh));
+    accumulate_unicast_short(neigh, (neigh->ifp->hello_interval * 3 + 9) / 10);
+    if(ll)
+        accumulate_unicast_bytes(neigh, neigh->address + 8, 8);
+    else
+        accumulate_unicast_bytes(neigh, neigh->address, 16);
+    accumulate_unicast_byte(neigh, SUBTLV_DIGEST);
+    accumulate_unicast_byte(neigh, DIGEST_ACK_LEN);
+    accumulate_unicast_byte(neigh, 1);
+    accumulate_unicast_byte(neigh, bucket);
+    accumulate_unicast_short(neigh, mask);
+    end_unicast_message(neigh, MESSAGE_IHU, msglen);
+}
+
 /* Send IHUs to all marginal neighbours */
 void
 send_marginal_ihu(struct interface *ifp)
@@ -1737,7 +2550,7 @@ send_marginal_ihu(struct interface *ifp)
     FOR_ALL_NEIGHBOURS(neigh) {
         if(ifp && neigh->ifp != ifp)
             continue;
-        if(neigh->txcost >= 384 || (neigh->reach & 0xF000) != 0xF000)
+        if(neigh->txcost >= 384 || (neighbour_reach(neigh) & 0xF000) != 0xF000)
             send_ihu(neigh, ifp);
     }
 }
@@ -1822,6 +2635,48 @@ send_request(struct interface *ifp,
     end_message(ifp, MESSAGE_REQUEST, len);
 }
 
+/* A wildcard request carrying a Prefix Range sub-TLV.  Nodes that
+   don't understand the sub-TLV ignore it and send a full dump. */
+void
+send_request_range(struct interface *ifp,
+                   const unsigned char *prefix, unsigned char plen)
+{
+    int v4, pb, len;
+
+    if(ifp == NULL) {
+        struct interface *ifp_aux;
+        FOR_ALL_INTERFACES(ifp_aux)
+            send_request_range(ifp_aux, prefix, plen);
+        return;
+    }
+
+    /* make sure any buffered updates go out before this request. */
+    flushupdates(ifp);
+
+    if(!if_up(ifp))
+        return;
+
+    debugf("sending request to %s for any within %s.\n", ifp->name,
+           format_prefix(prefix, plen));
+
+    v4 = plen >= 96 && v4mapped(prefix);
+    pb = v4 ? ((plen - 96) + 7) / 8 : (plen + 7) / 8;
+    len = 2 + 4 + pb;
+
+    start_message(ifp, MESSAGE_REQUEST, len);
+    accumulate_byte(ifp, 0);
+    accumulate_byte(ifp, 0);
+    accumulate_byte(ifp, SUBTLV_PREFIX_RANGE);
+    accumulate_byte(ifp, 2 + pb);
+    accumulate_byte(ifp, v4 ? 1 : 2);
+    accumulate_byte(ifp, v4 ? plen - 96 : plen);
+    if(v4)
+        accumulate_bytes(ifp, prefix + 12, pb);
+    else
+        accumulate_bytes(ifp, prefix, pb);
+    end_message(ifp, MESSAGE_REQUEST, len);
+}
+
 void
 send_unicast_request(struct neighbour *neigh,
                      const unsigned char *prefix, unsigned char plen,
@@ -1893,6 +2748,30 @@ send_unicast_request(struct neighbour *neigh,
     end_unicast_message(neigh, MESSAGE_REQUEST, len);
 }
 
+/* A wildcard request carrying our digests of the leaves of a bucket;
+   the neighbour only resends the leaves that differ. */
+void
+send_digest_request(struct neighbour *neigh, int bucket,
+                    const unsigned int *digests)
+{
+    int rc, i;
+
+    debugf("Sending digest request to %s for bucket %d.\n",
+           format_address(neigh->address), bucket);
+
+    rc = start_unicast_message(neigh, MESSAGE_REQUEST, 4 + DIGEST_NODE_LEN);
+    if(rc < 0) return;
+    accumulate_unicast_byte(neigh, 0);
+    accumulate_unicast_byte(neigh, 0);
+    accumulate_unicast_byte(neigh, SUBTLV_DIGEST);
+    accumulate_unicast_byte(neigh, DIGEST_NODE_LEN);
+    accumulate_unicast_byte(neigh, 1);
+    accumulate_unicast_byte(neigh, bucket);
+    for(i = 0; i < DIGEST_FANOUT; i++)
+        accumulate_unicast_int(neigh, digests[i]);
+    end_unicast_message(neigh, MESSAGE_REQUEST, 4 + DIGEST_NODE_LEN);
+}
+
 void
 send_multihop_request(struct interface *ifp,
                       const unsigned char *prefix, unsigned char plen,
@@ -2039,7 +2918,11 @@ handle_request(struct neighbour *neigh, const unsigned char *prefix,
     xroute = find_xroute(prefix, plen, src_prefix, src_plen);
     route = find_installed_route(prefix, plen, src_prefix, src_plen);
 
-    if(xroute && (!route || xroute->metric <= kernel_metric)) {
+    /* We originate summaries, so we handle requests for them just like
+       requests for our exported routes. */
+    if((xroute && (!route || xroute->metric <= kernel_metric)) ||
+       summary_filter(id, prefix, plen, src_prefix, src_plen,
+                      neigh->ifp->ifindex)) {
         if(hop_count > 0 && memcmp(id, myid, 8) == 0) {
             if(seqno_compare(seqno, myseqno) > 0) {
                 if(seqno_minus(seqno, myseqno) > 100) {
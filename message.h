@@ -21,10 +21,25 @@ THE SOFTWARE.
 */
 
 #define MAX_BUFFERED_UPDATES 200
+#define MAX_SUMMARIES 16
 
 #define BUCKET_TOKENS_MAX 4000
 #define BUCKET_TOKENS_PER_SEC 1000
 
+/* Packets queued per neighbour when receive-rate is exceeded. */
+#define MAX_RECEIVE_BACKLOG 64
+
+/* On unicast interfaces, Unicast Hellos are sent to every neighbour,
+   and a Multicast Hello is sent once every this many, so that new
+   neighbours can discover us. */
+#define UNICAST_DISCOVERY_HELLOS 4
+
+/* Cost of a byte of airtime on wireless interfaces.  Multicast is sent
+   at the lowest basic rate, unicast typically an order of magnitude
+   faster. */
+#define RATE_CLASS_MULTICAST 10
+#define RATE_CLASS_UNICAST 1
+
 #define MESSAGE_PAD1 0
 #define MESSAGE_PADN 1
 #define MESSAGE_ACK_REQ 2
@@ -41,11 +56,23 @@ THE SOFTWARE.
 #define MESSAGE_REQUEST_SRC_SPECIFIC 14
 #define MESSAGE_MH_REQUEST_SRC_SPECIFIC 15
 
+/* The U flag of Hellos (RFC 8966), set on Unicast Hellos. */
+#define HELLO_FLAG_UNICAST 0x8000
+
 /* Protocol extension through sub-TLVs. */
 #define SUBTLV_PAD1 0
 #define SUBTLV_PADN 1
 #define SUBTLV_DIVERSITY 2 /* Also known as babelz. */
 #define SUBTLV_TIMESTAMP 3 /* Used to compute RTT. */
+/* Experimental sub-TLVs use types 112 to 126, which are below the
+   mandatory bit, so that other implementations ignore them. */
+#define SUBTLV_DIGEST 112 /* Anti-entropy digests. */
+#define SUBTLV_PREFIX_RANGE 113 /* Restricts a wildcard request. */
+
+/* Which messages parse_packet handles. */
+#define PARSE_LINK 1            /* Hello and IHU */
+#define PARSE_OTHER 2
+#define PARSE_ALL (PARSE_LINK | PARSE_OTHER)
 
 extern unsigned short myseqno;
 extern struct timeval seqno_time;
@@ -57,9 +84,17 @@ extern unsigned char packet_header[4];
 
 extern struct neighbour *unicast_neighbour;
 extern struct timeval unicast_flush_timeout;
+extern struct timeval receive_backlog_time;
 
+int network_prefix(int ae, int plen, unsigned int omitted,
+                   const unsigned char *p, const unsigned char *dp,
+                   unsigned int len, unsigned char *p_r);
 void parse_packet(const unsigned char *from, struct interface *ifp,
-                  const unsigned char *packet, int packetlen);
+                  const unsigned char *packet, int packetlen, int which);
+void receive_packet(const unsigned char *from, struct interface *ifp,
+                    const unsigned char *packet, int packetlen);
+void process_receive_backlog(void);
+void flush_receive_backlog(struct neighbour *neigh);
 void flushbuf(struct interface *ifp);
 void flushupdates(struct interface *ifp);
 void send_ack(struct neighbour *neigh, unsigned short nonce,
@@ -67,6 +102,13 @@ void send_ack(struct neighbour *neigh, unsigned short nonce,
 void send_hello_noupdate(struct interface *ifp, unsigned interval);
 void send_hello(struct interface *ifp);
 void flush_unicast(int dofree);
+void really_send_update(struct interface *ifp,
+                        const unsigned char *id,
+                        const unsigned char *prefix, unsigned char plen,
+                        const unsigned char *src_prefix,
+                        unsigned char src_plen,
+                        unsigned short seqno, unsigned short metric,
+                        unsigned char *channels, int channels_len);
 void send_update(struct interface *ifp, int urgent,
                  const unsigned char *prefix, unsigned char plen,
                  const unsigned char *src_prefix, unsigned char src_plen);
@@ -74,18 +116,25 @@ void send_update_resend(struct interface *ifp,
                         const unsigned char *prefix, unsigned char plen,
                         const unsigned char *src_prefix,
                         unsigned char src_plen);
+void send_update_within(struct interface *ifp,
+                        const unsigned char *prefix, unsigned char plen);
 void send_wildcard_retraction(struct interface *ifp);
 void update_myseqno(void);
 void send_self_update(struct interface *ifp);
 void send_ihu(struct neighbour *neigh, struct interface *ifp);
 void send_marginal_ihu(struct interface *ifp);
+void send_digest_ack(struct neighbour *neigh, int bucket, unsigned short mask);
 void send_request(struct interface *ifp,
                   const unsigned char *prefix, unsigned char plen,
                   const unsigned char *src_prefix, unsigned char src_plen);
+void send_request_range(struct interface *ifp,
+                        const unsigned char *prefix, unsigned char plen);
 void send_unicast_request(struct neighbour *neigh,
                           const unsigned char *prefix, unsigned char plen,
                           const unsigned char *src_prefix,
                           unsigned char src_plen);
+void send_digest_request(struct neighbour *neigh, int bucket,
+                         const unsigned int *digests);
 void send_multihop_request(struct interface *ifp,
                            const unsigned char *prefix, unsigned char plen,
                            const unsigned char *src_prefix,
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "babeld.h"
 #include "util.h"
@@ -36,8 +37,11 @@ THE SOFTWARE.
 #include "message.h"
 #include "resend.h"
 #include "local.h"
+#include "kernel.h"
+#include "digest.h"
 
 struct neighbour *neighs = NULL;
+int resolve_neighbours = 0;
 
 static struct neighbour *
 find_neighbour_nocreate(const unsigned char *address, struct interface *ifp)
@@ -58,6 +62,7 @@ flush_neighbour(struct neighbour *neigh)
     if(unicast_neighbour == neigh)
         flush_unicast(1);
     flush_resends(neigh);
+    flush_receive_backlog(neigh);
 
     if(neighs == neigh) {
         neighs = neigh->next;
@@ -67,7 +72,11 @@ flush_neighbour(struct neighbour *neigh)
             previous = previous->next;
         previous->next = neigh->next;
     }
+    neigh->ifp->hello_template_len = 0;
+    if(neigh->digest)
+        digest_changed();
     local_notify_neighbour(neigh, LOCAL_FLUSH);
+    free(neigh->digest_leaves);
     free(neigh);
 }
 
@@ -90,65 +99,108 @@ find_neighbour(const unsigned char *address, struct interface *ifp)
         return NULL;
     }
 
-    neigh->hello_seqno = -1;
     memcpy(neigh->address, address, 16);
-    neigh->reach = 0;
+    neigh->hello.seqno = neigh->uhello.seqno = -1;
+    neigh->hello.reach = neigh->uhello.reach = 0;
+    neigh->hello.interval = neigh->uhello.interval = 0;
+    neigh->hello.time = neigh->uhello.time = zero;
     neigh->txcost = INFINITY;
     neigh->ihu_time = now;
-    neigh->hello_time = zero;
-    neigh->hello_interval = 0;
     neigh->ihu_interval = 0;
     neigh->hello_send_us = 0;
     neigh->hello_rtt_receive_time = zero;
     neigh->rtt = 0;
     neigh->rtt_time = zero;
+    neigh->digest = 0;
+    neigh->digest_leaves = NULL;
+    neigh->digest_generation = 0;
+    memset(neigh->nexthop4, 0, 16);
+    neigh->receive_tokens = 0;
+    neigh->receive_time = zero;
+    neigh->backlog = neigh->backlog_tail = NULL;
+    neigh->backlog_len = 0;
+    neigh->deferred = neigh->dropped = 0;
     neigh->ifp = ifp;
     neigh->next = neighs;
     neighs = neigh;
+    ifp->hello_template_len = 0;
     local_notify_neighbour(neigh, LOCAL_ADD);
     send_hello(ifp);
     return neigh;
 }
 
-/* Recompute a neighbour's rxcost.  Return true if anything changed.
+/* Used on upgrade.  The neighbour already knows us, so unlike
+   find_neighbour this doesn't send a Hello, which would carry an IHU
+   computed before we know the neighbour's reachability. */
+struct neighbour *
+restore_neighbour(const struct neighbour *model)
+{
+    struct neighbour *neigh;
+
+    neigh = find_neighbour_nocreate(model->address, model->ifp);
+    if(neigh == NULL) {
+        neigh = malloc(sizeof(struct neighbour));
+        if(neigh == NULL) {
+            perror("malloc(neighbour)");
+            return NULL;
+        }
+        *neigh = *model;
+        neigh->next = neighs;
+        neighs = neigh;
+        neigh->ifp->hello_template_len = 0;
+    } else {
+        struct neighbour *next = neigh->next;
+        free(neigh->digest_leaves);
+        *neigh = *model;
+        neigh->next = next;
+    }
+    local_notify_neighbour(neigh, LOCAL_ADD);
+    return neigh;
+}
+
+/* Recompute a neighbour's rxcost after receiving a Hello, or after
+   checking for missed ones if hello is -1.  hist is the history of
+   either Multicast or Unicast Hellos.  Return true if anything changed.
    This does not call local_notify_neighbour, see update_neighbour_metric. */
 int
-update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
+update_neighbour(struct neighbour *neigh, struct hello_history *hist,
+                 int hello, int hello_interval)
 {
     int missed_hellos;
+    unsigned short reach;
     int rc = 0;
 
     if(hello < 0) {
-        if(neigh->hello_interval <= 0)
+        if(hist->interval <= 0)
             return rc;
         missed_hellos =
-            ((int)timeval_minus_msec(&now, &neigh->hello_time) -
-             neigh->hello_interval * 7) /
-            (neigh->hello_interval * 10);
+            ((int)timeval_minus_msec(&now, &hist->time) -
+             hist->interval * 7) /
+            (hist->interval * 10);
         if(missed_hellos <= 0)
             return rc;
-        timeval_add_msec(&neigh->hello_time, &neigh->hello_time,
-                         missed_hellos * neigh->hello_interval * 10);
+        timeval_add_msec(&hist->time, &hist->time,
+                         missed_hellos * hist->interval * 10);
     } else {
-        if(neigh->hello_seqno >= 0 && neigh->reach > 0) {
-            missed_hellos = seqno_minus(hello, neigh->hello_seqno) - 1;
+        if(hist->seqno >= 0 && hist->reach > 0) {
+            missed_hellos = seqno_minus(hello, hist->seqno) - 1;
             if(missed_hellos < -8) {
                 /* Probably a neighbour that rebooted and lost its seqno.
                    Reboot the universe. */
-                neigh->reach = 0;
+                hist->reach = 0;
                 missed_hellos = 0;
                 rc = 1;
             } else if(missed_hellos < 0) {
-                if(hello_interval > neigh->hello_interval) {
+                if(hello_interval > hist->interval) {
                     /* This neighbour has increased its hello interval,
                        and we didn't notice. */
-                    neigh->reach <<= -missed_hellos;
+                    hist->reach <<= -missed_hellos;
                     missed_hellos = 0;
                 } else {
                     /* Late hello.  Probably due to the link layer buffering
                        packets during a link outage.  Ignore it, but reset
                        the expected seqno. */
-                    neigh->hello_seqno = hello;
+                    hist->seqno = hello;
                     hello = -1;
                     missed_hellos = 0;
                 }
@@ -157,40 +209,44 @@ update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
         } else {
             missed_hellos = 0;
         }
-        neigh->hello_time = now;
-        neigh->hello_interval = hello_interval;
+        hist->time = now;
+        hist->interval = hello_interval;
     }
 
     if(missed_hellos > 0) {
-        neigh->reach >>= missed_hellos;
-        neigh->hello_seqno = seqno_plus(neigh->hello_seqno, missed_hellos);
+        hist->reach >>= missed_hellos;
+        hist->seqno = seqno_plus(hist->seqno, missed_hellos);
         missed_hellos = 0;
         rc = 1;
     }
 
     if(hello >= 0) {
-        neigh->hello_seqno = hello;
-        neigh->reach >>= 1;
-        neigh->reach |= 0x8000;
-        if((neigh->reach & 0xFC00) != 0xFC00)
+        hist->seqno = hello;
+        hist->reach >>= 1;
+        hist->reach |= 0x8000;
+        if((hist->reach & 0xFC00) != 0xFC00)
             rc = 1;
     }
 
+    /* Both kinds of Hellos count towards association, so that a neighbour
+       that starts sending Unicast Hellos is not taken for a new one. */
+    reach = neighbour_reach(neigh);
+
     /* Make sure to give neighbours some feedback early after association */
-    if((neigh->reach & 0xBF00) == 0x8000) {
+    if((reach & 0xBF00) == 0x8000) {
         /* A new neighbour */
         send_hello(neigh->ifp);
     } else {
         /* Don't send hellos, in order to avoid a positive feedback loop. */
-        int a = (neigh->reach & 0xC000);
-        int b = (neigh->reach & 0x3000);
+        int a = (reach & 0xC000);
+        int b = (reach & 0x3000);
         if((a == 0xC000 && b == 0) || (a == 0 && b == 0x3000)) {
             /* Reachability is either 1100 or 0011 */
             send_self_update(neigh->ifp);
         }
     }
 
-    if((neigh->reach & 0xFC00) == 0xC000) {
+    if((reach & 0xFC00) == 0xC000) {
         /* This is a newish neighbour, let's request a full route dump.
            We ought to avoid this when the network is dense */
         send_unicast_request(neigh, NULL, 0, NULL, 0);
@@ -199,6 +255,12 @@ update_neighbour(struct neighbour *neigh, int hello, int hello_interval)
     return rc;
 }
 
+unsigned short
+neighbour_reach(struct neighbour *neigh)
+{
+    return neigh->hello.reach | neigh->uhello.reach;
+}
+
 static int
 reset_txcost(struct neighbour *neigh)
 {
@@ -210,7 +272,7 @@ reset_txcost(struct neighbour *neigh)
         return 0;
 
     /* If we're losing a lot of packets, we probably lost an IHU too */
-    if(delay >= 180000 || (neigh->reach & 0xFFF0) == 0 ||
+    if(delay >= 180000 || (neighbour_reach(neigh) & 0xFFF0) == 0 ||
        (neigh->ihu_interval > 0 &&
         delay >= neigh->ihu_interval * 10 * 10)) {
         neigh->txcost = INFINITY;
@@ -227,6 +289,47 @@ neighbour_txcost(struct neighbour *neigh)
     return neigh->txcost;
 }
 
+/* Have the kernel resolve the link-layer address of a neighbour's next
+   hops before we route through it, so that switching to it doesn't stall
+   while the kernel performs ND or ARP.  Called periodically, which keeps
+   the kernel's entries fresh. */
+static void
+resolve_neighbour(struct neighbour *neigh)
+{
+    int rc;
+
+    if(neighbour_cost(neigh) >= INFINITY)
+        return;
+
+    rc = kernel_resolve_neighbour(neigh->address, neigh->ifp->ifindex);
+    if(rc >= 0 && v4mapped(neigh->nexthop4))
+        rc = kernel_resolve_neighbour(neigh->nexthop4, neigh->ifp->ifindex);
+    if(rc < 0)
+        debugf("Couldn't resolve neighbour %s: %s.\n",
+               format_address(neigh->address), strerror(errno));
+}
+
+/* Called for every update, in order to learn the neighbour's IPv4 next
+   hop. */
+void
+neighbour_nexthop(struct neighbour *neigh, const unsigned char *nexthop)
+{
+    if(!v4mapped(nexthop) || memcmp(neigh->nexthop4, nexthop, 16) == 0)
+        return;
+
+    memcpy(neigh->nexthop4, nexthop, 16);
+    if(resolve_neighbours && neighbour_cost(neigh) < INFINITY)
+        kernel_resolve_neighbour(nexthop, neigh->ifp->ifindex);
+}
+
+/* Whether we haven't heard this kind of Hello for five minutes. */
+static int
+hello_stale(const struct hello_history *hist)
+{
+    return hist->time.tv_sec > now.tv_sec || /* clock stepped */
+        timeval_minus_msec(&now, &hist->time) > 300000;
+}
+
 unsigned
 check_neighbours()
 {
@@ -238,11 +341,12 @@ check_neighbours()
 
     neigh = neighs;
     while(neigh) {
-        changed = update_neighbour(neigh, -1, 0);
+        changed = update_neighbour(neigh, &neigh->hello, -1, 0);
+        rc = update_neighbour(neigh, &neigh->uhello, -1, 0);
+        changed = changed || rc;
 
-        if(neigh->reach == 0 ||
-           neigh->hello_time.tv_sec > now.tv_sec || /* clock stepped */
-           timeval_minus_msec(&now, &neigh->hello_time) > 300000) {
+        if(neighbour_reach(neigh) == 0 ||
+           (hello_stale(&neigh->hello) && hello_stale(&neigh->uhello))) {
             struct neighbour *old = neigh;
             neigh = neigh->next;
             flush_neighbour(old);
@@ -254,8 +358,13 @@ check_neighbours()
 
         update_neighbour_metric(neigh, changed);
 
-        if(neigh->hello_interval > 0)
-            msecs = MIN(msecs, neigh->hello_interval * 10);
+        if(resolve_neighbours)
+            resolve_neighbour(neigh);
+
+        if(neigh->hello.interval > 0)
+            msecs = MIN(msecs, neigh->hello.interval * 10);
+        if(neigh->uhello.interval > 0)
+            msecs = MIN(msecs, neigh->uhello.interval * 10);
         if(neigh->ihu_interval > 0)
             msecs = MIN(msecs, neigh->ihu_interval * 10);
         neigh = neigh->next;
@@ -264,13 +373,13 @@ check_neighbours()
     return msecs;
 }
 
-unsigned
-neighbour_rxcost(struct neighbour *neigh)
+static unsigned
+hello_rxcost(struct neighbour *neigh, const struct hello_history *hist)
 {
     unsigned delay;
-    unsigned short reach = neigh->reach;
+    unsigned short reach = hist->reach;
 
-    delay = timeval_minus_msec(&now, &neigh->hello_time);
+    delay = timeval_minus_msec(&now, &hist->time);
 
     if((reach & 0xFFF0) == 0 || delay >= 180000) {
         return INFINITY;
@@ -298,6 +407,15 @@ neighbour_rxcost(struct neighbour *neigh)
     }
 }
 
+/* A neighbour that sends both kinds of Hellos is as good as the better
+   of the two links they measure. */
+unsigned
+neighbour_rxcost(struct neighbour *neigh)
+{
+    return MIN(hello_rxcost(neigh, &neigh->hello),
+               hello_rxcost(neigh, &neigh->uhello));
+}
+
 unsigned
 neighbour_rttcost(struct neighbour *neigh)
 {
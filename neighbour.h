@@ -20,16 +20,21 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+struct hello_history {
+    /* This is -1 when unknown, so don't make it unsigned */
+    int seqno;
+    unsigned short reach;
+    unsigned short interval;    /* in centiseconds */
+    struct timeval time;
+};
+
 struct neighbour {
     struct neighbour *next;
-    /* This is -1 when unknown, so don't make it unsigned */
-    int hello_seqno;
     unsigned char address[16];
-    unsigned short reach;
+    /* Multicast and Unicast Hellos have independent seqnos. */
+    struct hello_history hello, uhello;
     unsigned short txcost;
-    struct timeval hello_time;
     struct timeval ihu_time;
-    unsigned short hello_interval; /* in centiseconds */
     unsigned short ihu_interval;   /* in centiseconds */
     /* Used for RTT estimation. */
     /* Absolute time (modulo 2^32) at which the Hello was sent,
@@ -38,10 +43,26 @@ struct neighbour {
     struct timeval hello_rtt_receive_time;
     unsigned int rtt;
     struct timeval rtt_time;
+    /* Whether the last Hello advertised support for digests, the
+       router-id it carried and our view of what the neighbour announces,
+       see neighbour_leaves. */
+    int digest;
+    unsigned char digest_id[8];
+    unsigned int *digest_leaves;
+    unsigned int digest_generation;
+    /* The IPv4 next hop last announced, zero if none. */
+    unsigned char nexthop4[16];
+    /* Receive rate limiting, see receive_packet. */
+    int receive_tokens;
+    struct timeval receive_time;
+    struct deferred_packet *backlog, *backlog_tail;
+    int backlog_len;
+    unsigned int deferred, dropped;
     struct interface *ifp;
 };
 
 extern struct neighbour *neighs;
+extern int resolve_neighbours;
 
 #define FOR_ALL_NEIGHBOURS(_neigh) \
     for(_neigh = neighs; _neigh; _neigh = _neigh->next)
@@ -50,7 +71,11 @@ int neighbour_valid(struct neighbour *neigh);
 void flush_neighbour(struct neighbour *neigh);
 struct neighbour *find_neighbour(const unsigned char *address,
                                  struct interface *ifp);
-int update_neighbour(struct neighbour *neigh, int hello, int hello_interval);
+struct neighbour *restore_neighbour(const struct neighbour *model);
+int update_neighbour(struct neighbour *neigh, struct hello_history *hist,
+                     int hello, int hello_interval);
+unsigned short neighbour_reach(struct neighbour *neigh);
+void neighbour_nexthop(struct neighbour *neigh, const unsigned char *nexthop);
 unsigned check_neighbours(void);
 unsigned neighbour_txcost(struct neighbour *neigh);
 unsigned neighbour_rxcost(struct neighbour *neigh);
@@ -0,0 +1,314 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* For the register names in ucontext. */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "babeld.h"
+#include "profile.h"
+
+/* Samples are taken from the registers saved in the signal context, and
+   the rest of the stack is found by following frame pointers, which are
+   only available if babeld was compiled with -fno-omit-frame-pointer.
+   Frame pointers are only followed between the interrupted stack pointer
+   and the top of the stack, so that a build without them yields short
+   stacks rather than a crash. */
+
+#if defined(__linux__) && \
+    (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__))
+
+#include <ucontext.h>
+
+#if defined(__x86_64__)
+#define CONTEXT_PC(uc) ((void*)(uc)->uc_mcontext.gregs[REG_RIP])
+#define CONTEXT_SP(uc) ((uintptr_t)(uc)->uc_mcontext.gregs[REG_RSP])
+#define CONTEXT_FP(uc) ((void**)(uc)->uc_mcontext.gregs[REG_RBP])
+#elif defined(__i386__)
+#define CONTEXT_PC(uc) ((void*)(uc)->uc_mcontext.gregs[REG_EIP])
+#define CONTEXT_SP(uc) ((uintptr_t)(uc)->uc_mcontext.gregs[REG_ESP])
+#define CONTEXT_FP(uc) ((void**)(uc)->uc_mcontext.gregs[REG_EBP])
+#else
+#define CONTEXT_PC(uc) ((void*)(uc)->uc_mcontext.pc)
+#define CONTEXT_SP(uc) ((uintptr_t)(uc)->uc_mcontext.sp)
+#define CONTEXT_FP(uc) ((void**)(uc)->uc_mcontext.regs[29])
+#endif
+
+/* Provided by the linker. */
+extern char __executable_start[], etext[];
+
+/* The buffer holds, for each sample, its depth followed by its return
+   addresses.  It is only written by the signal handler. */
+static void **samples = NULL;
+static volatile int samples_used = 0;
+static volatile int running = 0;
+static uintptr_t stack_high;
+
+static void
+profile_handler(int signo, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    void **fp, **next;
+    uintptr_t low = CONTEXT_SP(uc);
+    int start, n = 0;
+
+    if(samples_used + 1 + PROFILE_MAX_DEPTH > PROFILE_BUFFER_SIZE)
+        return;
+
+    start = samples_used;
+    samples[start + 1 + n++] = CONTEXT_PC(uc);
+    fp = CONTEXT_FP(uc);
+    while(n < PROFILE_MAX_DEPTH) {
+        if((uintptr_t)fp < low ||
+           (uintptr_t)fp > stack_high - 2 * sizeof(void*) ||
+           (uintptr_t)fp % sizeof(void*) != 0)
+            break;
+        if(fp[1] == NULL)
+            break;
+        /* Return addresses point after the call. */
+        samples[start + 1 + n++] = (char*)fp[1] - 1;
+        next = fp[0];
+        if(next <= fp)
+            break;
+        fp = next;
+    }
+    samples[start] = (void*)(uintptr_t)n;
+    samples_used = start + 1 + n;
+}
+
+static int
+find_stack(void)
+{
+    FILE *maps;
+    char line[512];
+    unsigned long low, high;
+    uintptr_t here = (uintptr_t)&low;
+
+    maps = fopen("/proc/self/maps", "r");
+    if(maps == NULL)
+        return -1;
+
+    while(fgets(line, sizeof(line), maps)) {
+        if(sscanf(line, "%lx-%lx", &low, &high) != 2)
+            continue;
+        if(here >= low && here < high) {
+            stack_high = high;
+            fclose(maps);
+            return 1;
+        }
+    }
+    fclose(maps);
+    errno = ENOENT;
+    return -1;
+}
+
+int
+profile_running(void)
+{
+    return running;
+}
+
+int
+profile_start(void)
+{
+    struct sigaction sa;
+    struct itimerval it;
+    int rc;
+
+    if(running) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    rc = find_stack();
+    if(rc < 0)
+        return -1;
+
+    free(samples);
+    samples = malloc(PROFILE_BUFFER_SIZE * sizeof(void*));
+    if(samples == NULL)
+        return -1;
+    samples_used = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = profile_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    rc = sigaction(SIGPROF, &sa, NULL);
+    if(rc < 0)
+        return -1;
+
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = PROFILE_INTERVAL;
+    it.it_value = it.it_interval;
+    rc = setitimer(ITIMER_PROF, &it, NULL);
+    if(rc < 0)
+        return -1;
+
+    running = 1;
+    return 1;
+}
+
+void
+profile_stop(void)
+{
+    struct itimerval it;
+
+    if(!running)
+        return;
+
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    /* A signal might still be pending. */
+    signal(SIGPROF, SIG_IGN);
+    running = 0;
+}
+
+/* The PC of a frame, in the form expected by addr2line. */
+int
+format_frame(char *buf, int len, void *pc)
+{
+    if((char*)pc < __executable_start || (char*)pc >= etext)
+        return snprintf(buf, len, "[unknown]");
+#ifdef __PIE__
+    return snprintf(buf, len, "0x%lx",
+                    (unsigned long)((char*)pc - __executable_start));
+#else
+    return snprintf(buf, len, "0x%lx", (unsigned long)pc);
+#endif
+}
+
+#else
+
+static void **samples = NULL;
+static int samples_used = 0;
+
+int
+profile_running(void)
+{
+    return 0;
+}
+
+int
+profile_start(void)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+profile_stop(void)
+{
+}
+
+int
+format_frame(char *buf, int len, void *pc)
+{
+    return snprintf(buf, len, "%p", pc);
+}
+
+#endif
+
+struct profile_stream {
+    int *offsets;
+    int numsamples;
+    int next;
+    struct profile_stack stack;
+};
+
+static int
+compare_samples(const void *av, const void *bv)
+{
+    int a = *(const int*)av, b = *(const int*)bv;
+    int da = (int)(uintptr_t)samples[a], db = (int)(uintptr_t)samples[b];
+
+    if(da != db)
+        return da < db ? -1 : 1;
+    return memcmp(samples + a + 1, samples + b + 1, da * sizeof(void*));
+}
+
+/* Identical stacks are merged.  Call this after profile_stop. */
+struct profile_stream *
+profile_stream(void)
+{
+    struct profile_stream *stream;
+    int i = 0, n = 0;
+
+    stream = calloc(1, sizeof(struct profile_stream));
+    if(stream == NULL)
+        return NULL;
+
+    if(samples == NULL || samples_used == 0)
+        return stream;
+
+    stream->offsets = malloc(PROFILE_BUFFER_SIZE * sizeof(int));
+    if(stream->offsets == NULL) {
+        free(stream);
+        return NULL;
+    }
+
+    while(i < samples_used) {
+        stream->offsets[n++] = i;
+        i += 1 + (int)(uintptr_t)samples[i];
+    }
+    stream->numsamples = n;
+    qsort(stream->offsets, n, sizeof(int), compare_samples);
+    return stream;
+}
+
+struct profile_stack *
+profile_stream_next(struct profile_stream *stream)
+{
+    int first;
+
+    if(stream->next >= stream->numsamples)
+        return NULL;
+
+    first = stream->next;
+    while(stream->next < stream->numsamples &&
+          compare_samples(&stream->offsets[first],
+                          &stream->offsets[stream->next]) == 0)
+        stream->next++;
+
+    stream->stack.count = stream->next - first;
+    stream->stack.depth = (int)(uintptr_t)samples[stream->offsets[first]];
+    stream->stack.pcs = samples + stream->offsets[first] + 1;
+    return &stream->stack;
+}
+
+void
+profile_stream_done(struct profile_stream *stream)
+{
+    free(stream->offsets);
+    free(stream);
+    free(samples);
+    samples = NULL;
+    samples_used = 0;
+}
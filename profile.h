@@ -0,0 +1,45 @@
+/*
+Copyright (c) 2015 by Juliusz Chroboczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* A sampling profiler, driven from the local interface. */
+
+#define PROFILE_INTERVAL 5000     /* microseconds of CPU time */
+#define PROFILE_BUFFER_SIZE 32768 /* return addresses, including headers */
+#define PROFILE_MAX_DEPTH 32
+
+struct profile_stack {
+    int count;
+    int depth;
+    /* Leaf first. */
+    void **pcs;
+};
+
+struct profile_stream;
+
+int profile_running(void);
+int profile_start(void);
+void profile_stop(void);
+struct profile_stream *profile_stream(void);
+struct profile_stack *profile_stream_next(struct profile_stream *stream);
+void profile_stream_done(struct profile_stream *stream);
+int format_frame(char *buf, int len, void *pc);
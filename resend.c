@@ -36,6 +36,48 @@ THE SOFTWARE.
 struct timeval resend_time = {0, 0};
 struct resend *to_resend = NULL;
 
+/* Resends are also chained in a hash table, so that recording a resend
+   doesn't need to walk the whole list.  This matters when a neighbour
+   carrying many routes goes away. */
+#define RESEND_HASH_SIZE 4096
+static struct resend **resend_hash = NULL;
+
+static unsigned int
+resend_hash_index(int kind, const unsigned char *prefix, unsigned char plen,
+                  const unsigned char *src_prefix, unsigned char src_plen)
+{
+    unsigned int h = kind;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        h = h * 31 + prefix[i];
+    h = h * 31 + plen;
+    if(src_plen != 0) {
+        for(i = 0; i < 16; i++)
+            h = h * 31 + src_prefix[i];
+        h = h * 31 + src_plen;
+    }
+    return h % RESEND_HASH_SIZE;
+}
+
+static void
+resend_hash_remove(struct resend *resend)
+{
+    struct resend **rp;
+
+    rp = &resend_hash[resend_hash_index(resend->kind,
+                                        resend->prefix, resend->plen,
+                                        resend->src_prefix,
+                                        resend->src_plen)];
+    while(*rp) {
+        if(*rp == resend) {
+            *rp = resend->hash_next;
+            return;
+        }
+        rp = &(*rp)->hash_next;
+    }
+}
+
 static int
 resend_match(struct resend *resend,
              int kind, const unsigned char *prefix, unsigned char plen,
@@ -57,21 +99,19 @@ flush_resends(struct neighbour *neigh)
 
 static struct resend *
 find_resend(int kind, const unsigned char *prefix, unsigned char plen,
-            const unsigned char *src_prefix, unsigned char src_plen,
-            struct resend **previous_return)
+            const unsigned char *src_prefix, unsigned char src_plen)
 {
-    struct resend *current, *previous;
+    struct resend *current;
+
+    if(resend_hash == NULL)
+        return NULL;
 
-    previous = NULL;
-    current = to_resend;
+    current = resend_hash[resend_hash_index(kind, prefix, plen,
+                                            src_prefix, src_plen)];
     while(current) {
-        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen)) {
-            if(previous_return)
-                *previous_return = previous;
+        if(resend_match(current, kind, prefix, plen, src_prefix, src_plen))
             return current;
-        }
-        previous = current;
-        current = current->next;
+        current = current->hash_next;
     }
 
     return NULL;
@@ -79,11 +119,9 @@ find_resend(int kind, const unsigned char *prefix, unsigned char plen,
 
 struct resend *
 find_request(const unsigned char *prefix, unsigned char plen,
-             const unsigned char *src_prefix, unsigned char src_plen,
-             struct resend **previous_return)
+             const unsigned char *src_prefix, unsigned char src_plen)
 {
-    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen,
-                       previous_return);
+    return find_resend(RESEND_REQUEST, prefix, plen, src_prefix, src_plen);
 }
 
 int
@@ -107,7 +145,7 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
     if(delay >= 0xFFFF)
         delay = 0xFFFF;
 
-    resend = find_resend(kind, prefix, plen, src_prefix, src_plen, NULL);
+    resend = find_resend(kind, prefix, plen, src_prefix, src_plen);
     if(resend) {
         if(resend->delay && delay)
             resend->delay = MIN(resend->delay, delay);
@@ -127,6 +165,12 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         if(resend->ifp != ifp)
             resend->ifp = NULL;
     } else {
+        unsigned int h;
+        if(resend_hash == NULL) {
+            resend_hash = calloc(RESEND_HASH_SIZE, sizeof(struct resend*));
+            if(resend_hash == NULL)
+                return -1;
+        }
         resend = malloc(sizeof(struct resend));
         if(resend == NULL)
             return -1;
@@ -146,6 +190,9 @@ record_resend(int kind, const unsigned char *prefix, unsigned char plen,
         resend->time = now;
         resend->next = to_resend;
         to_resend = resend;
+        h = resend_hash_index(kind, prefix, plen, src_prefix, src_plen);
+        resend->hash_next = resend_hash[h];
+        resend_hash[h] = resend;
     }
 
     if(resend->delay) {
@@ -174,7 +221,7 @@ unsatisfied_request(const unsigned char *prefix, unsigned char plen,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -194,7 +241,7 @@ request_redundant(struct interface *ifp,
 {
     struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, NULL);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL || resend_expired(request))
         return 0;
 
@@ -223,9 +270,9 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
                 unsigned short seqno, const unsigned char *id,
                 struct interface *ifp)
 {
-    struct resend *request, *previous;
+    struct resend *request;
 
-    request = find_request(prefix, plen, src_prefix, src_plen, &previous);
+    request = find_request(prefix, plen, src_prefix, src_plen);
     if(request == NULL)
         return 0;
 
@@ -245,16 +292,25 @@ satisfy_request(const unsigned char *prefix, unsigned char plen,
     return 0;
 }
 
-void
-expire_resend()
+/* Since expire_resend is the only function that frees resends, and new
+   resends are prepended, it is safe to remember our position in the list
+   between calls. */
+static struct resend *expire_previous = NULL;
+
+int
+expire_resend(int budget)
 {
     struct resend *current, *previous;
-    int recompute = 0;
+    int recompute = 0, n = 0;
 
-    previous = NULL;
-    current = to_resend;
+    previous = expire_previous;
+    current = previous ? previous->next : to_resend;
     while(current) {
+        if(budget > 0 && n >= budget)
+            break;
+        n++;
         if(resend_expired(current)) {
+            resend_hash_remove(current);
             if(previous == NULL) {
                 to_resend = current->next;
                 free(current);
@@ -272,6 +328,13 @@ expire_resend()
     }
     if(recompute)
         recompute_resend_time();
+
+    if(current) {
+        expire_previous = previous;
+        return 1;
+    }
+    expire_previous = NULL;
+    return 0;
 }
 
 void
@@ -39,13 +39,14 @@ struct resend {
     unsigned char id[8];
     struct interface *ifp;
     struct resend *next;
+    struct resend *hash_next;
 };
 
 extern struct timeval resend_time;
+extern struct resend *to_resend;
 
 struct resend *find_request(const unsigned char *prefix, unsigned char plen,
-                    const unsigned char *src_prefix, unsigned char src_plen,
-                    struct resend **previous_return);
+                    const unsigned char *src_prefix, unsigned char src_plen);
 void flush_resends(struct neighbour *neigh);
 int record_resend(int kind, const unsigned char *prefix, unsigned char plen,
                   const unsigned char *src_prefix, unsigned char src_plen,
@@ -63,6 +64,6 @@ int satisfy_request(const unsigned char *prefix, unsigned char plen,
                     unsigned short seqno, const unsigned char *id,
                     struct interface *ifp);
 
-void expire_resend(void);
+int expire_resend(int budget);
 void recompute_resend_time(void);
 void do_resend(void);
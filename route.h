@@ -40,6 +40,7 @@ struct babel_route {
     unsigned short smoothed_metric; /* for route selection */
     time_t smoothed_metric_time;
     short installed;
+    short flushing;              /* used by bulk flushes */
     unsigned char channels[DIVERSITY_HOPS];
     struct babel_route *next;
 };
@@ -47,12 +48,14 @@ struct babel_route {
 #define ROUTE_ALL 0
 #define ROUTE_INSTALLED 1
 #define ROUTE_SS_INSTALLED 2
+#define ROUTE_WITHIN 3
 struct route_stream;
 
 extern struct babel_route **routes;
 extern int kernel_metric, allow_duplicates, reflect_kernel_metric;
 extern int diversity_kind, diversity_factor;
 extern int keep_unfeasible;
+extern struct timeval unfeasible_request_time;
 
 static inline int
 route_metric(const struct babel_route *route)
@@ -79,11 +82,14 @@ struct babel_route *find_installed_route(const unsigned char *prefix,
                         unsigned char plen, const unsigned char *src_prefix,
                         unsigned char src_plen);
 int installed_routes_estimate(void);
+struct babel_route *restore_route(const struct babel_route *model);
 void flush_route(struct babel_route *route);
 void flush_all_routes(void);
 void flush_neighbour_routes(struct neighbour *neigh);
 void flush_interface_routes(struct interface *ifp, int v4only);
 struct route_stream *route_stream(int which);
+struct route_stream *route_stream_within(const unsigned char *prefix,
+                                         unsigned char plen);
 struct babel_route *route_stream_next(struct route_stream *stream);
 void route_stream_done(struct route_stream *stream);
 int metric_to_kernel(int metric);
@@ -119,10 +125,11 @@ void retract_neighbour_routes(struct neighbour *neigh);
 void send_unfeasible_request(struct neighbour *neigh, int force,
                              unsigned short seqno, unsigned short metric,
                              struct source *src);
+void send_unfeasible_requests(void);
 void consider_route(struct babel_route *route);
 void send_triggered_update(struct babel_route *route,
                            struct source *oldsrc, unsigned oldmetric);
 void route_changed(struct babel_route *route,
                    struct source *oldsrc, unsigned short oldmetric);
 void route_lost(struct source *src, unsigned oldmetric);
-void expire_routes(void);
+int expire_routes(int budget);
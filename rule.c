@@ -199,6 +199,32 @@ find_table(const unsigned char *dest, unsigned short plen,
     return kr == NULL ? -1 : kr->table;
 }
 
+/* Used to pass our rules to a new instance on upgrade.  Returns 0 if
+   slot i is unused. */
+int
+get_rule(int i, const unsigned char **src_r, int *plen_r, int *table_r)
+{
+    if(i < 0 || i >= SRC_TABLE_NUM || rules[i].plen == 0)
+        return 0;
+    *src_r = rules[i].src;
+    *plen_r = rules[i].plen;
+    *table_r = rules[i].table;
+    return 1;
+}
+
+int
+restore_rule(int i, const unsigned char *src, int plen, int table)
+{
+    if(i < 0 || i >= SRC_TABLE_NUM || plen <= 0 ||
+       table < src_table_idx || table >= src_table_idx + SRC_TABLE_NUM)
+        return -1;
+    memcpy(rules[i].src, src, 16);
+    rules[i].plen = plen;
+    rules[i].table = table;
+    used_tables[table - src_table_idx] = 1;
+    return 1;
+}
+
 void
 release_tables(void)
 {
@@ -281,21 +307,37 @@ install_missing_rules(char rule_exists[SRC_TABLE_NUM], int v4)
     }
 }
 
+/* Rules seen in the last kernel dump, filled in by filter_rule. */
+static char rule_exists[2][SRC_TABLE_NUM]; /* v4, v6 */
+
+/* Make FILTER collect our rules during a kernel dump, so that a single
+   dump serves both check_xroutes and the rule check. */
+void
+kernel_rules_filter(struct kernel_filter *filter)
+{
+    memset(rule_exists, 0, sizeof(rule_exists));
+    filter->rule = filter_rule;
+    filter->rule_closure = (void*)rule_exists;
+}
+
+void
+install_kernel_rules(void)
+{
+    install_missing_rules(rule_exists[0], 1);
+    install_missing_rules(rule_exists[1], 0);
+}
+
 int
 check_rules(void)
 {
     int rc;
-    char rule_exists[2][SRC_TABLE_NUM]; /* v4, v6 */
     struct kernel_filter filter = {0};
-    filter.rule = filter_rule;
-    filter.rule_closure = (void*) rule_exists;
-    memset(rule_exists, 0, sizeof(rule_exists));
 
+    kernel_rules_filter(&filter);
     rc = kernel_dump(CHANGE_RULE, &filter);
     if(rc < 0)
         return -1;
-    install_missing_rules(rule_exists[0], 1);
-    install_missing_rules(rule_exists[1], 0);
+    install_kernel_rules();
 
     return 0;
 }
@@ -22,6 +22,8 @@ THE SOFTWARE.
 
 #define SRC_TABLE_NUM 10
 
+struct kernel_filter;
+
 extern int src_table_idx; /* number of the first table */
 extern int src_table_prio; /* first prio range */
 
@@ -30,4 +32,8 @@ extern int src_table_prio; /* first prio range */
 int find_table(const unsigned char *dest, unsigned short plen,
                const unsigned char *src, unsigned short src_plen);
 void release_tables(void);
+int get_rule(int i, const unsigned char **src_r, int *plen_r, int *table_r);
+int restore_rule(int i, const unsigned char *src, int plen, int table);
+void kernel_rules_filter(struct kernel_filter *filter);
+void install_kernel_rules(void);
 int check_rules(void);
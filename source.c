@@ -34,6 +34,25 @@ THE SOFTWARE.
 
 static struct source **sources = NULL;
 static int source_slots = 0, max_source_slots = 0;
+/* The slot of the last lookup, see find_route_slot. */
+static int last_source_slot = 0;
+/* While expire_sources is between slices, the slots in
+   [gap_start, gap_end) are empty; the slots before the gap have been
+   examined, the ones after it have not.  Other functions index the
+   table through source_at, which skips the gap. */
+static int gap_start = 0, gap_end = 0;
+
+static int
+num_sources(void)
+{
+    return source_slots - (gap_end - gap_start);
+}
+
+static struct source *
+source_at(int i)
+{
+    return sources[i < gap_start ? i : i + (gap_end - gap_start)];
+}
 
 static int
 source_compare(const unsigned char *id,
@@ -69,27 +88,55 @@ find_source_slot(const unsigned char *id,
                  const unsigned char *src_prefix, unsigned char src_plen,
                  int *new_return)
 {
-    int p, m, g, c;
+    int p, m, g, c, n = num_sources();
 
-    if(source_slots < 1) {
+    if(n < 1) {
         if(new_return)
             *new_return = 0;
         return -1;
     }
 
-    p = 0; g = source_slots - 1;
+    m = last_source_slot;
+    if(m < n) {
+        c = source_compare(id, prefix, plen, src_prefix, src_plen,
+                           source_at(m));
+        if(c == 0)
+            return m;
+        if(c > 0) {
+            if(m + 1 >= n) {
+                p = n;
+                goto notfound;
+            }
+            c = source_compare(id, prefix, plen, src_prefix, src_plen,
+                               source_at(m + 1));
+            if(c == 0) {
+                last_source_slot = m + 1;
+                return m + 1;
+            } else if(c < 0) {
+                p = m + 1;
+                goto notfound;
+            }
+        }
+    }
+
+    p = 0; g = n - 1;
 
     do {
         m = (p + g) / 2;
-        c = source_compare(id, prefix, plen, src_prefix, src_plen, sources[m]);
-        if(c == 0)
+        c = source_compare(id, prefix, plen, src_prefix, src_plen,
+                           source_at(m));
+        if(c == 0) {
+            last_source_slot = m;
             return m;
-        else if(c < 0)
+        } else if(c < 0) {
             g = m - 1;
-        else
+        } else {
             p = m + 1;
+        }
     } while(p <= g);
 
+ notfound:
+    last_source_slot = p;
     if(new_return)
         *new_return = p;
 
@@ -127,7 +174,7 @@ find_source(const unsigned char *id,
     struct source *src;
 
     if(i >= 0)
-        return sources[i];
+        return source_at(i);
 
     if(!create)
         return NULL;
@@ -148,6 +195,23 @@ find_source(const unsigned char *id,
     src->time = now.tv_sec;
     src->route_count = 0;
 
+    if(gap_start < gap_end) {
+        /* Fill the gap from whichever side the new source belongs to. */
+        if(n <= gap_start) {
+            memmove(sources + n + 1, sources + n,
+                    (gap_start - n) * sizeof(struct source*));
+            gap_start++;
+        } else {
+            n += gap_end - gap_start;
+            memmove(sources + gap_end - 1, sources + gap_end,
+                    (n - gap_end) * sizeof(struct source*));
+            gap_end--;
+            n--;
+        }
+        sources[n] = src;
+        return src;
+    }
+
     if(source_slots >= max_source_slots)
         resize_source_table(max_source_slots < 1 ? 8 : 2 * max_source_slots);
     if(source_slots >= max_source_slots) {
@@ -159,6 +223,11 @@ find_source(const unsigned char *id,
                 (source_slots - n) * sizeof(struct source*));
     source_slots++;
     sources[n] = src;
+    /* Keep the cursor of expire_sources on the same source. */
+    if(n < gap_end) {
+        gap_start++;
+        gap_end++;
+    }
 
     return src;
 }
@@ -198,31 +267,76 @@ update_source(struct source *src,
     src->time = now.tv_sec;
 }
 
-void
-expire_sources()
+int
+expire_sources(int budget)
 {
-    int i = 0, j = 0;
+    int i, j, n = 0;
+
+    /* Surviving sources are moved down to the start of the gap, so that
+       each slice only touches the slots it examines. */
+    i = gap_end;
+    j = gap_start;
     while(i < source_slots) {
-        struct source *src = sources[i];
+        struct source *src;
+
+        if(budget > 0 && n >= budget)
+            break;
+        n++;
+
+        src = sources[i];
+        sources[i] = NULL;
+        i++;
 
         if(src->time > now.tv_sec)
             /* clock stepped */
             src->time = now.tv_sec;
 
-        if(src->route_count == 0 && src->time < now.tv_sec - SOURCE_GC_TIME) {
+        if(src->route_count == 0 && src->time < now.tv_sec - SOURCE_GC_TIME)
             free(src);
-            sources[i] = NULL;
-            i++;
-        } else {
-            if(j < i) {
-                sources[j] = sources[i];
-                sources[i] = NULL;
-            }
-            i++;
-            j++;
-        }
+        else
+            sources[j++] = src;
     }
+
+    if(i < source_slots) {
+        gap_start = j;
+        gap_end = i;
+        return 1;
+    }
+
+    /* The gap has reached the end of the table. */
     source_slots = j;
+    gap_start = gap_end = 0;
+    return 0;
+}
+
+struct source_stream {
+    int index;
+};
+
+struct source_stream *
+source_stream(void)
+{
+    struct source_stream *stream = malloc(sizeof(struct source_stream));
+    if(stream == NULL)
+        return NULL;
+
+    stream->index = 0;
+    return stream;
+}
+
+struct source *
+source_stream_next(struct source_stream *stream)
+{
+    if(stream->index < num_sources())
+        return source_at(stream->index++);
+    else
+        return NULL;
+}
+
+void
+source_stream_done(struct source_stream *stream)
+{
+    free(stream);
 }
 
 void
@@ -230,8 +344,8 @@ check_sources_released(void)
 {
     int i;
 
-    for(i = 0; i < source_slots; i++) {
-        struct source *src = sources[i];
+    for(i = 0; i < num_sources(); i++) {
+        struct source *src = source_at(i);
 
         if(src->route_count != 0)
             fprintf(stderr, "Warning: source %s %s has refcount %d.\n",
@@ -34,6 +34,8 @@ struct source {
     time_t time;
 };
 
+struct source_stream;
+
 struct source *find_source(const unsigned char *id,
                            const unsigned char *prefix,
                            unsigned char plen,
@@ -44,5 +46,8 @@ struct source *retain_source(struct source *src);
 void release_source(struct source *src);
 void update_source(struct source *src,
                    unsigned short seqno, unsigned short metric);
-void expire_sources(void);
+int expire_sources(int budget);
+struct source_stream *source_stream(void);
+struct source *source_stream_next(struct source_stream *stream);
+void source_stream_done(struct source_stream *stream);
 void check_sources_released(void);
@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include "babeld.h"
 #include "kernel.h"
 #include "neighbour.h"
+#include "source.h"
 #include "message.h"
 #include "route.h"
 #include "xroute.h"
@@ -38,6 +39,8 @@ THE SOFTWARE.
 #include "configuration.h"
 #include "interface.h"
 #include "local.h"
+#include "digest.h"
+#include "rule.h"
 
 static struct xroute *xroutes;
 static int numxroutes = 0, maxxroutes = 0;
@@ -66,6 +69,8 @@ flush_xroute(struct xroute *xroute)
     assert(i >= 0 && i < numxroutes);
 
     local_notify_xroute(xroute, LOCAL_FLUSH);
+    digest_changed();
+    summary_changed(xroute->prefix, xroute->plen);
 
     if(i != numxroutes - 1)
         memcpy(xroutes + i, xroutes + numxroutes - 1, sizeof(struct xroute));
@@ -98,6 +103,8 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
             return 0;
         xroute->metric = metric;
         local_notify_xroute(xroute, LOCAL_CHANGE);
+        digest_changed();
+        summary_changed(xroute->prefix, xroute->plen);
         return 1;
     }
 
@@ -122,6 +129,9 @@ add_xroute(unsigned char prefix[16], unsigned char plen,
     xroutes[numxroutes].proto = proto;
     numxroutes++;
     local_notify_xroute(&xroutes[numxroutes - 1], LOCAL_ADD);
+    digest_changed();
+    summary_changed(xroutes[numxroutes - 1].prefix,
+                    xroutes[numxroutes - 1].plen);
     return 1;
 }
 
@@ -164,6 +174,119 @@ xroute_stream_done(struct xroute_stream *stream)
     free(stream);
 }
 
+/* A summary is announced as if it were one of our exported routes.  Its
+   metric is the largest metric of its components, or INFINITY if it has
+   no reachable components left.  As for other routes, components learnt
+   on the interface are skipped with split horizon, and metrics account
+   for interference.  The result is cached for each interface until a
+   route within the summary changes, see summary_changed. */
+
+struct summary_state {
+    unsigned int ifindex;
+    int valid;
+    unsigned int generation;
+    int count;
+    unsigned short metric;
+    struct summary_state *next;
+};
+
+static void
+summary_components(struct filter *f, struct interface *ifp,
+                   int *count_r, int *metric_r)
+{
+    struct route_stream *routes;
+    struct babel_route *route;
+    int i, count = 0, metric = 0;
+
+    for(i = 0; i < numxroutes; i++) {
+        if(xroutes[i].plen < f->plen ||
+           !in_prefix(xroutes[i].prefix, f->prefix, f->plen))
+            continue;
+        if(summary_filter(myid, xroutes[i].prefix, xroutes[i].plen,
+                          xroutes[i].src_prefix, xroutes[i].src_plen,
+                          ifp->ifindex) != f)
+            continue;
+        route = find_installed_route(xroutes[i].prefix, xroutes[i].plen,
+                                     xroutes[i].src_prefix,
+                                     xroutes[i].src_plen);
+        if(route && xroutes[i].metric > kernel_metric)
+            continue;
+        count++;
+        metric = MAX(metric, xroutes[i].metric);
+    }
+
+    /* Components lie within the prefix of the summary. */
+    routes = route_stream_within(f->prefix, f->plen);
+    if(routes == NULL) {
+        fprintf(stderr, "Couldn't allocate route stream.\n");
+        *count_r = count;
+        *metric_r = metric;
+        return;
+    }
+    while(1) {
+        struct xroute *xroute;
+        int m;
+        route = route_stream_next(routes);
+        if(route == NULL)
+            break;
+        if((ifp->flags & IF_SPLIT_HORIZON) && route->neigh->ifp == ifp)
+            continue;
+        m = route_interferes(route, ifp) ?
+            route_metric(route) : route_metric_noninterfering(route);
+        if(m >= INFINITY)
+            continue;
+        if(summary_filter(route->src->id,
+                          route->src->prefix, route->src->plen,
+                          route->src->src_prefix, route->src->src_plen,
+                          ifp->ifindex) != f)
+            continue;
+        xroute = find_xroute(route->src->prefix, route->src->plen,
+                             route->src->src_prefix, route->src->src_plen);
+        if(xroute && xroute->metric <= kernel_metric)
+            continue;
+        count++;
+        metric = MAX(metric, m);
+    }
+    route_stream_done(routes);
+
+    *count_r = count;
+    *metric_r = metric;
+}
+
+int
+summary_metric(struct filter *f, struct interface *ifp)
+{
+    struct summary_state *state;
+    int count, metric;
+
+    for(state = f->summary_states; state; state = state->next) {
+        if(state->ifindex == ifp->ifindex)
+            break;
+    }
+
+    if(state == NULL) {
+        state = calloc(1, sizeof(struct summary_state));
+        if(state == NULL) {
+            perror("malloc(summary_state)");
+            summary_components(f, ifp, &count, &metric);
+            return count > 0 ? metric : INFINITY;
+        }
+        state->ifindex = ifp->ifindex;
+        state->next = f->summary_states;
+        f->summary_states = state;
+    }
+
+    if(!state->valid || state->generation != f->summary_generation) {
+        summary_components(f, ifp, &count, &metric);
+        state->count = count;
+        state->metric = metric;
+        state->generation = f->summary_generation;
+        state->valid = 1;
+    }
+
+    return state->count > 0 ? state->metric : INFINITY;
+}
+
 static int
 filter_route(struct kernel_route *route, void *data) {
     void **args = (void**)data;
@@ -184,16 +307,25 @@ filter_route(struct kernel_route *route, void *data) {
     return 0;
 }
 
+/* If rules is true, the same dump also collects our source-specific
+   rules, which are then reinstalled if needed. */
 static int
-kernel_routes(struct kernel_route *routes, int maxroutes)
+kernel_routes(struct kernel_route *routes, int maxroutes, int rules)
 {
-    int found = 0;
+    int found = 0, rc;
     void *data[3] = { &maxroutes, routes, &found };
     struct kernel_filter filter = {0};
     filter.route = filter_route;
     filter.route_closure = data;
+    if(rules)
+        kernel_rules_filter(&filter);
+
+    rc = kernel_dump(CHANGE_ROUTE | (rules ? CHANGE_RULE : 0), &filter);
+    if(rc < 0)
+        return -1;
 
-    kernel_dump(CHANGE_ROUTE, &filter);
+    if(rules)
+        install_kernel_rules();
 
     return found;
 }
@@ -248,7 +380,7 @@ kernel_addresses(int ifindex, int ll, struct kernel_route *routes,
 }
 
 int
-check_xroutes(int send_updates)
+check_xroutes(int send_updates, int rules)
 {
     int i, j, metric, export, change = 0, rc;
     struct kernel_route *routes;
@@ -277,11 +409,14 @@ check_xroutes(int send_updates)
 
     numaddresses = numroutes;
 
-    rc = kernel_routes(routes + numroutes, maxroutes - numroutes);
-    if(rc < 0)
+    rc = kernel_routes(routes + numroutes, maxroutes - numroutes, rules);
+    if(rc < 0) {
         fprintf(stderr, "Couldn't get kernel routes.\n");
-    else
+    } else {
         numroutes += rc;
+        /* No need to check the rules again if we need to resize. */
+        rules = 0;
+    }
 
     if(numroutes >= maxroutes)
         goto resize;
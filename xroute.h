@@ -31,6 +31,8 @@ struct xroute {
 };
 
 struct xroute_stream;
+struct filter;
+struct interface;
 
 struct xroute *find_xroute(const unsigned char *prefix, unsigned char plen,
                 const unsigned char *src_prefix, unsigned char src_plen);
@@ -39,9 +41,10 @@ int add_xroute(unsigned char prefix[16], unsigned char plen,
                unsigned char src_prefix[16], unsigned char src_plen,
                unsigned short metric, unsigned int ifindex, int proto);
 int xroutes_estimate(void);
+int summary_metric(struct filter *f, struct interface *ifp);
 struct xroute_stream *xroute_stream();
 struct xroute *xroute_stream_next(struct xroute_stream *stream);
 void xroute_stream_done(struct xroute_stream *stream);
 int kernel_addresses(int ifindex, int ll,
                      struct kernel_route *routes, int maxroutes);
-int check_xroutes(int send_updates);
+int check_xroutes(int send_updates, int rules);